@@ -0,0 +1,12 @@
+#include <cstddef>
+
+// Running totals of this thread's allocations, maintained by count_allocation().
+// This lives apart from memory.h so that memory_tracking.cpp can count
+// allocations without including the rest of the library.
+inline thread_local size_t thread_allocated_bytes = 0;
+inline thread_local size_t thread_allocation_count = 0;
+
+inline void count_allocation(size_t bytes) {
+    thread_allocated_bytes += bytes;
+    thread_allocation_count++;
+}
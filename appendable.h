@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <thread>
+#include <vector>
+
+// A k-way union of sorted runs of a dataframe. Yields the entries of all the
+// runs in tag order. Among entries with the same tag, those of earlier runs
+// come first.
+template <typename _Tag, typename _Value>
+struct Expr_MergedRuns : Expr_Operations<Expr_MergedRuns<_Tag, _Value>> {
+    using Tag = Expr_DataFrame<_Tag, _Value>::Tag;
+    using Value = Expr_DataFrame<_Tag, _Value>::Value;
+
+    std::vector<Expr_DataFrame<_Tag, _Value>> runs;
+
+    // The run with the smallest tag, or runs.size() at the end.
+    size_t current;
+
+    Expr_MergedRuns(const std::vector<DataFrame<_Tag, _Value>> &dfs) {
+        for (const auto &df : dfs)
+            runs.emplace_back(df);
+        pick();
+    }
+
+    // Compaction keeps the number of runs small, so this scans them rather
+    // than maintaining a heap.
+    void pick() {
+        current = runs.size();
+        for (size_t r = 0; r < runs.size(); ++r)
+            if (!runs[r].end() && (current == runs.size() || runs[r].tag() < runs[current].tag()))
+                current = r;
+    }
+
+    decltype(auto) tag() const { return runs[current].tag(); }
+
+    decltype(auto) value() const { return runs[current].value(); }
+
+    void next() {
+        runs[current].next();
+        pick();
+    }
+
+    bool end() const { return current == runs.size(); }
+
+    // Moves every run to its first tag that's at least t, so the entries after
+    // t keep coming from all the runs.
+    void advance_to_tag(Tag t) {
+        for (auto &run : runs)
+            run.i = *std::ranges::partition_point(std::views::iota(size_t(0), run.df.size()),
+                                                  [&](size_t j) { return (*run.df.tags)[j] < t; });
+        pick();
+        if (!end() && tag() != t) {
+            // Didn't find the tag. It's the end of this expression.
+            for (auto &run : runs)
+                run.i = run.df.size();
+            current = runs.size();
+        }
+    }
+};
+
+/* A dataframe that rows can be appended to in any tag order.
+
+Like a log-structured merge tree, appended rows go into a sorted in-memory
+buffer, and when the buffer holds buffer_capacity rows, it's frozen into an
+immutable sorted run. A background thread compacts the runs. Whenever a
+run is at least half as long as the run before it, it merges the two. That
+keeps the runs in decreasing order of length, so there are O(log n) of
+them, and each row gets merged O(log n) times.
+
+to_expr() freezes the buffer and returns a merged view of the runs. The view
+streams from a snapshot of the runs, which later appends and compactions don't
+affect. Like DataFrames, copies of an AppendableDataFrame refer to the same
+rows.
+*/
+template <typename Tag, typename Value>
+struct AppendableDataFrame {
+    struct State {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::multimap<Tag, Value> buffer;
+        std::vector<DataFrame<Tag, Value>> runs;  // Oldest first.
+        size_t buffer_capacity;
+        bool background;
+        bool compacting = false;
+        bool stopping = false;
+        size_t num_compactions = 0;
+        std::thread compactor;
+
+        ~State() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            if (compactor.joinable())
+                compactor.join();
+        }
+
+        // The newest pair of adjacent runs where the older run is less than
+        // twice as long as the newer one, or runs.size() if there's none.
+        size_t run_to_compact() const {
+            for (size_t i = runs.size(); i-- > 1;)
+                if (runs[i - 1].size() <= 2 * runs[i].size())
+                    return i - 1;
+            return runs.size();
+        }
+
+        bool needs_compaction() const { return run_to_compact() < runs.size(); }
+
+        // Merge runs i and i+1. Doesn't hold the lock while merging, so
+        // appends can continue. Runs frozen in the meantime go after the
+        // merged run.
+        void merge_runs(size_t i, std::unique_lock<std::mutex> &lock) {
+            compacting = true;
+            std::vector<DataFrame<Tag, Value>> pair = {runs[i], runs[i + 1]};
+            lock.unlock();
+            auto merged = Expr_MergedRuns<Tag, Value>(pair).template materialize_as<Tag, Value>();
+            lock.lock();
+            runs.erase(runs.begin() + i, runs.begin() + i + 2);
+            runs.insert(runs.begin() + i, merged);
+            compacting = false;
+            num_compactions++;
+            cv.notify_all();
+        }
+
+        void compact_in_background() {
+            std::unique_lock lock(mutex);
+            while (true) {
+                cv.wait(lock, [this] { return stopping || (!compacting && needs_compaction()); });
+                if (stopping)
+                    return;
+                merge_runs(run_to_compact(), lock);
+            }
+        }
+
+        void freeze_buffer(std::unique_lock<std::mutex> &lock) {
+            if (buffer.empty())
+                return;
+            DataFrame<Tag, Value> run;
+            run.tags->reserve(buffer.size());
+            run.values->reserve(buffer.size());
+            for (auto &[t, v] : buffer) {
+                run.tags->push_back(t);
+                run.values->push_back(v);
+            }
+            buffer.clear();
+            runs.push_back(run);
+
+            if (background)
+                cv.notify_all();
+            else if (!compacting)
+                while (needs_compaction())
+                    merge_runs(run_to_compact(), lock);
+        }
+    };
+
+    std::shared_ptr<State> state;
+
+    AppendableDataFrame(size_t buffer_capacity = 1 << 16, bool background_compaction = true) : state(new State) {
+        state->buffer_capacity = std::max<size_t>(buffer_capacity, 1);
+        state->background = background_compaction;
+        if (background_compaction)
+            state->compactor = std::thread([s = state.get()] { s->compact_in_background(); });
+    }
+
+    // Takes O(log buffer_capacity) time, plus the amortized cost of freezing
+    // and compacting.
+    void append(const Tag &t, const Value &v) {
+        std::unique_lock lock(state->mutex);
+        state->buffer.emplace(t, v);
+        if (state->buffer.size() >= state->buffer_capacity)
+            state->freeze_buffer(lock);
+    }
+
+    // Freeze the rows in the buffer into a run.
+    void flush() {
+        std::unique_lock lock(state->mutex);
+        state->freeze_buffer(lock);
+    }
+
+    size_t size() const {
+        std::lock_guard lock(state->mutex);
+        size_t n = state->buffer.size();
+        for (const auto &run : state->runs)
+            n += run.size();
+        return n;
+    }
+
+    size_t num_runs() const {
+        std::lock_guard lock(state->mutex);
+        return state->runs.size();
+    }
+
+    size_t num_compactions() const {
+        std::lock_guard lock(state->mutex);
+        return state->num_compactions;
+    }
+
+    // Wait for the background thread to finish compacting the runs.
+    void wait_for_compaction() {
+        std::unique_lock lock(state->mutex);
+        state->cv.wait(lock, [this] { return !state->compacting && !state->needs_compaction(); });
+    }
+
+    // Merge all the runs, including the buffer, into one.
+    void compact() {
+        std::unique_lock lock(state->mutex);
+        state->cv.wait(lock, [this] { return !state->compacting; });
+        state->compacting = true;
+        state->freeze_buffer(lock);
+        auto runs = state->runs;
+        if (runs.size() < 2) {
+            state->compacting = false;
+            state->cv.notify_all();
+            return;
+        }
+        lock.unlock();
+        auto merged = Expr_MergedRuns<Tag, Value>(runs).template materialize_as<Tag, Value>();
+        lock.lock();
+        state->runs.erase(state->runs.begin(), state->runs.begin() + runs.size());
+        state->runs.insert(state->runs.begin(), merged);
+        state->compacting = false;
+        state->num_compactions++;
+        state->cv.notify_all();
+    }
+
+    auto to_expr() {
+        std::unique_lock lock(state->mutex);
+        state->freeze_buffer(lock);
+        return Expr_MergedRuns<Tag, Value>(state->runs);
+    }
+
+    auto materialize() { return to_expr().template materialize_as<Tag, Value>(); }
+};
@@ -0,0 +1,661 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Reads and writes dataframes as Apache Arrow IPC files, the format of
+// pyarrow.ipc.new_file and of Feather v2 files, without the Arrow library.
+//
+// A dataframe is stored as a table with a "tag" column and a "value" column,
+// or just a "value" column when its tags are RangeTags. Integer, floating
+// point and string columns are supported. Columns can't have nulls, and can't
+// be dictionary encoded or compressed.
+//
+// An Arrow file is a stream of messages between two "ARROW1" magic strings: a
+// schema message, then record batch messages that each have a body holding
+// the buffers of every column, then a footer that locates the record batches.
+// The metadata of each message and the footer are flatbuffers, which
+// FlatBufferBuilder and FlatTable encode and decode.
+
+// Builds a flatbuffer from back to front, the way the flatbuffers library
+// does, so an object can only refer to objects that were built before it.
+// Objects are identified by their distance from the end of the buffer.
+struct FlatBufferBuilder {
+    std::string buf;
+    std::vector<std::pair<int, uint32_t>> fields;
+    uint32_t table_end = 0;
+
+    uint32_t size() const { return buf.size(); }
+
+    // Pad so the next n bytes end at a multiple of alignment from the end.
+    void pad(size_t n, size_t alignment) {
+        buf.insert(0, (alignment - (buf.size() + n) % alignment) % alignment, '\0');
+    }
+
+    void prepend(const void *data, size_t n, size_t alignment) {
+        pad(n, alignment);
+        buf.insert(0, static_cast<const char *>(data), n);
+    }
+
+    template <typename T>
+    void prepend(T v) {
+        prepend(&v, sizeof(v), sizeof(v));
+    }
+
+    void prepend_offset(uint32_t object) {
+        pad(4, 4);
+        prepend<uint32_t>(size() + 4 - object);
+    }
+
+    uint32_t add_string(std::string_view s) {
+        pad(s.size() + 1, 4);
+        buf.insert(0, 1, '\0');
+        buf.insert(0, s.data(), s.size());
+        prepend<uint32_t>(s.size());
+        return size();
+    }
+
+    template <typename T>
+    uint32_t add_struct_vector(const std::vector<T> &v) {
+        prepend(v.data(), v.size() * sizeof(T), std::max<size_t>(alignof(T), 4));
+        prepend<uint32_t>(v.size());
+        return size();
+    }
+
+    uint32_t add_offset_vector(const std::vector<uint32_t> &objects) {
+        for (auto o = objects.rbegin(); o != objects.rend(); ++o)
+            prepend_offset(*o);
+        prepend<uint32_t>(objects.size());
+        return size();
+    }
+
+    // Tables are built by calling start_table, then adding their fields, then
+    // calling end_table. Their fields must be built before start_table.
+    void start_table() {
+        fields.clear();
+        table_end = size();
+    }
+
+    template <typename T>
+    void add_field(int id, T v) {
+        prepend(v);
+        fields.push_back({id, size()});
+    }
+
+    void add_offset_field(int id, uint32_t object) {
+        prepend_offset(object);
+        fields.push_back({id, size()});
+    }
+
+    // Writes the table's vtable just before it.
+    uint32_t end_table() {
+        prepend<int32_t>(0);
+        uint32_t table = size();
+
+        int num_fields = 0;
+        for (auto [id, _] : fields)
+            num_fields = std::max(num_fields, id + 1);
+        std::vector<uint16_t> vtable(2 + num_fields, 0);
+        vtable[0] = vtable.size() * sizeof(uint16_t);
+        vtable[1] = table - table_end;
+        for (auto [id, position] : fields)
+            vtable[2 + id] = table - position;
+        prepend(vtable.data(), vtable.size() * sizeof(uint16_t), sizeof(uint16_t));
+
+        int32_t vtable_offset = size() - table;
+        std::memcpy(&buf[buf.size() - table], &vtable_offset, sizeof(vtable_offset));
+        return table;
+    }
+
+    std::string finish(uint32_t root) {
+        pad(4, 8);
+        prepend_offset(root);
+        return std::move(buf);
+    }
+};
+
+// A table in a flatbuffer. Throws if anything it reads lies outside the
+// buffer.
+struct FlatTable {
+    std::string_view buf;
+    size_t position;
+
+    static FlatTable root(std::string_view buf) { return FlatTable{buf, 0}.offset(0); }
+
+    template <typename T>
+    T read(size_t at) const {
+        if (at > buf.size() || buf.size() - at < sizeof(T))
+            throw std::runtime_error("read_arrow: corrupt metadata");
+        T v;
+        std::memcpy(&v, buf.data() + at, sizeof(T));
+        return v;
+    }
+
+    // The table that the offset at the given position points to.
+    FlatTable offset(size_t at) const { return FlatTable{buf, at + read<uint32_t>(at)}; }
+
+    // The position of a field, or 0 if the field is absent.
+    size_t field(int id) const {
+        size_t vtable = position - read<int32_t>(position);
+        if (read<uint16_t>(vtable) <= 4 + 2 * id)
+            return 0;
+        uint16_t field_offset = read<uint16_t>(vtable + 4 + 2 * id);
+        return field_offset ? position + field_offset : 0;
+    }
+
+    template <typename T>
+    T scalar(int id, T default_value = 0) const {
+        size_t at = field(id);
+        return at ? read<T>(at) : default_value;
+    }
+
+    FlatTable table(int id) const {
+        size_t at = field(id);
+        if (!at)
+            throw std::runtime_error("read_arrow: missing metadata");
+        return offset(at);
+    }
+
+    std::string_view string(int id) const {
+        size_t at = field(id);
+        if (!at)
+            return {};
+        size_t s = offset(at).position;
+        uint32_t n = read<uint32_t>(s);
+        if (buf.size() - s - 4 < n)
+            throw std::runtime_error("read_arrow: corrupt metadata");
+        return buf.substr(s + 4, n);
+    }
+
+    // The number of entries of a vector and the position of its first entry.
+    std::pair<size_t, size_t> vector(int id) const {
+        size_t at = field(id);
+        if (!at)
+            return {0, 0};
+        size_t v = offset(at).position;
+        return {read<uint32_t>(v), v + 4};
+    }
+};
+
+// The flatbuffer structs of the Arrow format.
+struct ArrowFieldNode {
+    int64_t length;
+    int64_t null_count;
+};
+
+struct ArrowBuffer {
+    int64_t offset;
+    int64_t length;
+};
+
+struct ArrowBlock {
+    int64_t offset;
+    int32_t metadata_length;
+    int32_t padding;
+    int64_t body_length;
+};
+
+constexpr char arrow_magic[8] = {'A', 'R', 'R', 'O', 'W', '1', '\0', '\0'};
+constexpr int16_t arrow_metadata_version = 4;
+constexpr uint32_t arrow_continuation = 0xFFFFFFFF;
+constexpr size_t arrow_alignment = 8;
+
+enum class ArrowMessageType : uint8_t { Schema = 1, RecordBatch = 3 };
+
+enum class ArrowTypeId : uint8_t {
+    Null = 1,
+    Int = 2,
+    FloatingPoint = 3,
+    Binary = 4,
+    Utf8 = 5,
+    LargeBinary = 19,
+    LargeUtf8 = 20,
+};
+
+// The type of a column. bit_width and is_signed describe Ints. precision is
+// 1 for 32-bit floats and 2 for 64-bit floats.
+struct ArrowType {
+    ArrowTypeId id;
+    int32_t bit_width = 0;
+    bool is_signed = false;
+    int16_t precision = 0;
+
+    bool operator==(const ArrowType &) const = default;
+
+    bool is_string() const {
+        return id == ArrowTypeId::Utf8 || id == ArrowTypeId::Binary || id == ArrowTypeId::LargeUtf8 ||
+               id == ArrowTypeId::LargeBinary;
+    }
+};
+
+// The Arrow type of a column of T's. Strings are written as LargeUtf8, whose
+// 64-bit offsets are the offsets of a StringArena.
+template <typename T>
+ArrowType arrow_type() {
+    if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>)
+        return ArrowType{ArrowTypeId::LargeUtf8};
+    else if constexpr (std::is_floating_point_v<T>) {
+        static_assert(sizeof(T) == 4 || sizeof(T) == 8, "Arrow files only support 32 and 64-bit floats");
+        return ArrowType{.id = ArrowTypeId::FloatingPoint, .precision = sizeof(T) == 4 ? 1 : 2};
+    } else {
+        static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>,
+                      "Arrow files only support integer, floating point and string columns");
+        return ArrowType{.id = ArrowTypeId::Int, .bit_width = 8 * sizeof(T), .is_signed = std::is_signed_v<T>};
+    }
+}
+
+template <typename T>
+std::string_view arrow_fixed_buffer(const T *entries, size_t begin, size_t end) {
+    return std::string_view(reinterpret_cast<const char *>(entries + begin), (end - begin) * sizeof(T));
+}
+
+// The buffers of rows [begin, end) of a column, except for the validity
+// buffer. Buffers that have to be computed are kept in scratch.
+template <typename T>
+std::vector<std::string_view> arrow_buffers(const std::vector<T> &v, size_t begin, size_t end,
+                                            std::deque<std::string> &) {
+    return {arrow_fixed_buffer(v.data(), begin, end)};
+}
+
+template <typename T>
+std::vector<std::string_view> arrow_buffers(const std::vector<Mapped<T>> &v, size_t begin, size_t end,
+                                            std::deque<std::string> &) {
+    return {arrow_fixed_buffer(v.entries, begin, end)};
+}
+
+inline std::vector<std::string_view> arrow_buffers(const std::vector<StringArena> &v, size_t begin, size_t end,
+                                                   std::deque<std::string> &scratch) {
+    auto &offsets = scratch.emplace_back((end - begin + 1) * sizeof(int64_t), '\0');
+    for (size_t i = begin; i <= end; ++i) {
+        int64_t offset = v.offsets[i] - v.offsets[begin];
+        std::memcpy(&offsets[(i - begin) * sizeof(int64_t)], &offset, sizeof(offset));
+    }
+    return {offsets, std::string_view(v.bytes).substr(v.offsets[begin], v.offsets[end] - v.offsets[begin])};
+}
+
+inline std::vector<std::string_view> arrow_buffers(const std::vector<std::string> &v, size_t begin, size_t end,
+                                                   std::deque<std::string> &scratch) {
+    auto &offsets = scratch.emplace_back((end - begin + 1) * sizeof(int64_t), '\0');
+    auto &bytes = scratch.emplace_back();
+    for (size_t i = begin; i < end; ++i) {
+        bytes += v[i];
+        int64_t offset = bytes.size();
+        std::memcpy(&offsets[(i - begin + 1) * sizeof(int64_t)], &offset, sizeof(offset));
+    }
+    return {offsets, bytes};
+}
+
+inline uint32_t add_arrow_field(FlatBufferBuilder &b, const std::string &name, const ArrowType &type) {
+    uint32_t name_string = b.add_string(name);
+    uint32_t children = b.add_offset_vector({});
+
+    b.start_table();
+    if (type.id == ArrowTypeId::Int) {
+        b.add_field<int32_t>(0, type.bit_width);
+        b.add_field<uint8_t>(1, type.is_signed);
+    } else if (type.id == ArrowTypeId::FloatingPoint)
+        b.add_field<int16_t>(0, type.precision);
+    uint32_t type_table = b.end_table();
+
+    b.start_table();
+    b.add_offset_field(0, name_string);
+    b.add_field<uint8_t>(1, false);
+    b.add_field<uint8_t>(2, uint8_t(type.id));
+    b.add_offset_field(3, type_table);
+    b.add_offset_field(5, children);
+    return b.end_table();
+}
+
+inline uint32_t add_arrow_schema(FlatBufferBuilder &b, const std::vector<std::pair<std::string, ArrowType>> &columns) {
+    std::vector<uint32_t> fields;
+    for (auto &[name, type] : columns)
+        fields.push_back(add_arrow_field(b, name, type));
+    uint32_t fields_vector = b.add_offset_vector(fields);
+
+    b.start_table();
+    b.add_field<int16_t>(0, 0);  // Little endian.
+    b.add_offset_field(1, fields_vector);
+    return b.end_table();
+}
+
+inline std::string arrow_message(FlatBufferBuilder &b, ArrowMessageType type, uint32_t header, int64_t body_length) {
+    b.start_table();
+    b.add_field<int64_t>(3, body_length);
+    b.add_offset_field(2, header);
+    b.add_field<int16_t>(0, arrow_metadata_version);
+    b.add_field<uint8_t>(1, uint8_t(type));
+    return b.finish(b.end_table());
+}
+
+// Writes a message's continuation marker, the length of its metadata, and
+// its metadata padded to a multiple of 8 bytes. Returns the number of bytes
+// written.
+inline int32_t write_arrow_message(BinaryWriter &w, const std::string &metadata) {
+    static const char zeros[arrow_alignment] = {};
+    int32_t length = (metadata.size() + arrow_alignment - 1) / arrow_alignment * arrow_alignment;
+    w.write(&arrow_continuation, sizeof(arrow_continuation));
+    w.write(&length, sizeof(length));
+    w.write(metadata.data(), metadata.size());
+    w.write(zeros, length - metadata.size());
+    return 8 + length;
+}
+
+// Write a materialized dataframe to an Arrow IPC file. The rows are split
+// into record batches of at most rows_per_batch rows.
+template <typename Tag, typename Value>
+void write_arrow(const DataFrame<Tag, Value> &df,
+                 const std::string &filename,
+                 size_t rows_per_batch = std::numeric_limits<size_t>::max()) {
+    auto f = std::unique_ptr<FILE, decltype(&std::fclose)>(std::fopen(filename.c_str(), "wb"), &std::fclose);
+    if (!f)
+        throw std::system_error(errno, std::system_category(), filename);
+    rows_per_batch = std::max<size_t>(rows_per_batch, 1);
+
+    constexpr bool has_tag_column = !std::is_same_v<Tag, RangeTag>;
+    std::vector<std::pair<std::string, ArrowType>> columns;
+    if constexpr (has_tag_column)
+        columns.push_back({"tag", arrow_type<std::remove_cvref_t<typename DataFrame<Tag, Value>::TagRef>>()});
+    columns.push_back({"value", arrow_type<std::remove_cvref_t<typename DataFrame<Tag, Value>::ValueRef>>()});
+
+    BinaryWriter w{f.get(), 0};
+    w.write(arrow_magic, sizeof(arrow_magic));
+    FlatBufferBuilder schema_builder;
+    write_arrow_message(w, arrow_message(schema_builder, ArrowMessageType::Schema,
+                                         add_arrow_schema(schema_builder, columns), 0));
+
+    std::vector<ArrowBlock> blocks;
+    for (size_t begin = 0; begin < df.size() || blocks.empty(); begin += rows_per_batch) {
+        size_t end = std::min(df.size(), begin + rows_per_batch);
+
+        std::deque<std::string> scratch;
+        std::vector<std::string_view> buffers;
+        std::vector<ArrowFieldNode> nodes;
+        auto add_column = [&](const auto &storage) {
+            nodes.push_back({int64_t(end - begin), 0});
+            buffers.push_back({});  // No validity buffer, since there are no nulls.
+            for (std::string_view buffer : arrow_buffers(storage, begin, end, scratch))
+                buffers.push_back(buffer);
+        };
+        if constexpr (has_tag_column)
+            add_column(*df.tags);
+        add_column(*df.values);
+
+        std::vector<ArrowBuffer> buffer_locations;
+        int64_t body_length = 0;
+        for (std::string_view buffer : buffers) {
+            buffer_locations.push_back({body_length, int64_t(buffer.size())});
+            body_length += (buffer.size() + arrow_alignment - 1) / arrow_alignment * arrow_alignment;
+        }
+
+        FlatBufferBuilder b;
+        uint32_t buffers_vector = b.add_struct_vector(buffer_locations);
+        uint32_t nodes_vector = b.add_struct_vector(nodes);
+        b.start_table();
+        b.add_field<int64_t>(0, end - begin);
+        b.add_offset_field(1, nodes_vector);
+        b.add_offset_field(2, buffers_vector);
+        uint32_t record_batch = b.end_table();
+
+        ArrowBlock block = {};
+        block.offset = w.offset;
+        block.metadata_length =
+            write_arrow_message(w, arrow_message(b, ArrowMessageType::RecordBatch, record_batch, body_length));
+        block.body_length = body_length;
+        static const char zeros[arrow_alignment] = {};
+        for (std::string_view buffer : buffers) {
+            w.write(buffer.data(), buffer.size());
+            w.write(zeros, (arrow_alignment - buffer.size() % arrow_alignment) % arrow_alignment);
+        }
+        blocks.push_back(block);
+    }
+
+    // The end of stream marker, then the footer.
+    uint32_t end_of_stream[2] = {arrow_continuation, 0};
+    w.write(end_of_stream, sizeof(end_of_stream));
+
+    FlatBufferBuilder b;
+    uint32_t blocks_vector = b.add_struct_vector(blocks);
+    uint32_t schema = add_arrow_schema(b, columns);
+    b.start_table();
+    b.add_field<int16_t>(0, arrow_metadata_version);
+    b.add_offset_field(1, schema);
+    b.add_offset_field(3, blocks_vector);
+    std::string footer = b.finish(b.end_table());
+    int32_t footer_length = footer.size();
+    w.write(footer.data(), footer.size());
+    w.write(&footer_length, sizeof(footer_length));
+    w.write(arrow_magic, 6);
+
+    if (std::fclose(f.release()) != 0)
+        throw std::system_error(errno, std::system_category(), filename);
+}
+
+// A column of one record batch, with the locations of its buffers in the
+// file.
+struct ArrowChunk {
+    size_t length;
+    std::vector<ArrowBuffer> buffers;
+};
+
+// A column of an Arrow file: its type, and its buffers in every record batch.
+struct ArrowColumn {
+    ArrowType type;
+    size_t num_rows = 0;
+    std::vector<ArrowChunk> chunks;
+};
+
+// The number of buffers that a column of the given type has in each record
+// batch.
+inline size_t arrow_num_buffers(ArrowTypeId id) {
+    switch (uint8_t(id)) {
+        case 1:  // Null
+            return 0;
+        case 2:   // Int
+        case 3:   // FloatingPoint
+        case 6:   // Bool
+        case 7:   // Decimal
+        case 8:   // Date
+        case 9:   // Time
+        case 10:  // Timestamp
+        case 11:  // Interval
+        case 15:  // FixedSizeBinary
+        case 18:  // Duration
+            return 2;
+        case 4:   // Binary
+        case 5:   // Utf8
+        case 19:  // LargeBinary
+        case 20:  // LargeUtf8
+            return 3;
+    }
+    throw std::runtime_error("read_arrow: nested columns aren't supported");
+}
+
+inline void read_column(const ArrowColumn &column, std::vector<RangeTag> &v) { v.sz = column.num_rows; }
+
+// Fixed width columns aren't copied when they're stored in one record batch.
+// The array points into the mapping.
+template <typename T>
+void read_column(std::shared_ptr<MappedFile> file, const ArrowColumn &column, std::vector<Mapped<T>> &v) {
+    if (column.type != arrow_type<T>())
+        throw std::runtime_error("read_arrow: the file stores a column of a different type");
+    for (const ArrowChunk &chunk : column.chunks)
+        if (size_t(chunk.buffers[1].length) / sizeof(T) < chunk.length)
+            throw std::runtime_error("read_arrow: a buffer is too short for its column");
+
+    if (column.chunks.size() == 1 && column.chunks[0].buffers[1].offset % alignof(T) == 0) {
+        v = std::vector<Mapped<T>>(file, column.chunks[0].buffers[1].offset, column.num_rows);
+        return;
+    }
+    std::vector<T> copy(column.num_rows);
+    char *out = reinterpret_cast<char *>(copy.data());
+    for (const ArrowChunk &chunk : column.chunks) {
+        std::memcpy(out, file->data + chunk.buffers[1].offset, chunk.length * sizeof(T));
+        out += chunk.length * sizeof(T);
+    }
+    v = std::vector<Mapped<T>>(std::move(copy));
+}
+
+template <typename Offset>
+void read_strings_chunk(const MappedFile &file, const ArrowChunk &chunk, std::vector<StringArena> &v) {
+    const char *offsets = file.data + chunk.buffers[1].offset;
+    auto offset = [&](size_t i) {
+        Offset o;
+        std::memcpy(&o, offsets + i * sizeof(Offset), sizeof(Offset));
+        return o;
+    };
+    if (size_t(chunk.buffers[1].length) / sizeof(Offset) < chunk.length + 1)
+        throw std::runtime_error("read_arrow: a buffer is too short for its column");
+    for (size_t i = 0; i < chunk.length; ++i)
+        if (offset(i + 1) < offset(i) || offset(i) < 0)
+            throw std::runtime_error("read_arrow: string offsets aren't increasing");
+    if (chunk.length && offset(chunk.length) > chunk.buffers[2].length)
+        throw std::runtime_error("read_arrow: a buffer is too short for its column");
+
+    Offset first = chunk.length ? offset(0) : 0;
+    size_t base = v.bytes.size();
+    v.bytes.append(file.data + chunk.buffers[2].offset + first, (chunk.length ? offset(chunk.length) : 0) - first);
+    for (size_t i = 1; i <= chunk.length; ++i)
+        v.offsets.push_back(base + offset(i) - first);
+}
+
+// Strings are copied into a StringArena.
+inline void read_column(std::shared_ptr<MappedFile> file, const ArrowColumn &column, std::vector<StringArena> &v) {
+    if (!column.type.is_string())
+        throw std::runtime_error("read_arrow: the file stores a column of a different type");
+    v.offsets.reserve(column.num_rows + 1);
+    bool large = column.type.id == ArrowTypeId::LargeUtf8 || column.type.id == ArrowTypeId::LargeBinary;
+    for (const ArrowChunk &chunk : column.chunks)
+        large ? read_strings_chunk<int64_t>(*file, chunk, v) : read_strings_chunk<int32_t>(*file, chunk, v);
+}
+
+inline ArrowType read_arrow_type(const FlatTable &field) {
+    ArrowType type{ArrowTypeId(field.scalar<uint8_t>(2))};
+    if (type.id == ArrowTypeId::Int) {
+        FlatTable t = field.table(3);
+        type.bit_width = t.scalar<int32_t>(0);
+        type.is_signed = t.scalar<uint8_t>(1);
+    } else if (type.id == ArrowTypeId::FloatingPoint)
+        type.precision = field.table(3).scalar<int16_t>(0);
+    return type;
+}
+
+// Find the columns with the given names in an Arrow file, and locate their
+// buffers in every record batch.
+inline std::vector<ArrowColumn> read_arrow_columns(const MappedFile &file, const std::vector<std::string> &names) {
+    std::string_view data = file.view();
+    if (data.size() < 2 * sizeof(arrow_magic) + sizeof(int32_t) || std::memcmp(data.data(), arrow_magic, 6) != 0 ||
+        std::memcmp(data.data() + data.size() - 6, arrow_magic, 6) != 0)
+        throw std::runtime_error("read_arrow: not an Arrow file");
+    int32_t footer_length;
+    std::memcpy(&footer_length, data.data() + data.size() - 10, sizeof(footer_length));
+    if (footer_length <= 0 || size_t(footer_length) > data.size() - 10 - sizeof(arrow_magic))
+        throw std::runtime_error("read_arrow: corrupt footer");
+    FlatTable footer = FlatTable::root(data.substr(data.size() - 10 - footer_length, footer_length));
+
+    // Find the index of each column's first node and buffer in the record
+    // batches, which list the nodes and buffers of every column in order.
+    FlatTable schema = footer.table(1);
+    if (schema.scalar<int16_t>(0) != 0)
+        throw std::runtime_error("read_arrow: big endian files aren't supported");
+    std::vector<ArrowColumn> columns(names.size());
+    std::vector<size_t> node_index(names.size()), buffer_index(names.size());
+    std::vector<bool> found(names.size(), false);
+    auto [num_fields, fields] = schema.vector(1);
+    for (size_t i = 0, num_buffers = 0; i < num_fields && std::count(found.begin(), found.end(), false); ++i) {
+        FlatTable field = footer.offset(fields + 4 * i);
+        ArrowType type = read_arrow_type(field);
+        for (size_t c = 0; c < names.size(); ++c)
+            if (!found[c] && field.string(0) == names[c]) {
+                if (field.field(4))
+                    throw std::runtime_error("read_arrow: dictionary encoded columns aren't supported");
+                found[c] = true;
+                columns[c].type = type;
+                node_index[c] = i;
+                buffer_index[c] = num_buffers;
+            }
+        num_buffers += arrow_num_buffers(type.id);
+    }
+    for (size_t c = 0; c < names.size(); ++c)
+        if (!found[c])
+            throw std::runtime_error("read_arrow: the file has no column named " + names[c]);
+
+    auto [num_batches, blocks] = footer.vector(3);
+    for (size_t b = 0; b < num_batches; ++b) {
+        auto block = footer.read<ArrowBlock>(blocks + sizeof(ArrowBlock) * b);
+        if (block.offset < 0 || block.metadata_length < 8 || block.body_length < 0 ||
+            size_t(block.offset) + block.metadata_length + block.body_length > data.size())
+            throw std::runtime_error("read_arrow: a record batch lies outside the file");
+
+        // Messages start with a continuation marker, except in old files.
+        size_t metadata = block.offset + 4;
+        if (FlatTable{data, 0}.read<uint32_t>(block.offset) == arrow_continuation)
+            metadata += 4;
+        FlatTable message = FlatTable::root(data.substr(metadata, block.offset + block.metadata_length - metadata));
+        if (message.scalar<uint8_t>(1) != uint8_t(ArrowMessageType::RecordBatch))
+            throw std::runtime_error("read_arrow: expected a record batch");
+        FlatTable record_batch = message.table(2);
+        if (record_batch.field(3))
+            throw std::runtime_error("read_arrow: compressed files aren't supported");
+
+        size_t body = block.offset + block.metadata_length;
+        auto [num_nodes, nodes] = record_batch.vector(1);
+        auto [num_buffers, buffers] = record_batch.vector(2);
+        for (size_t c = 0; c < names.size(); ++c) {
+            size_t n = arrow_num_buffers(columns[c].type.id);
+            if (node_index[c] >= num_nodes || buffer_index[c] + n > num_buffers)
+                throw std::runtime_error("read_arrow: corrupt record batch");
+            auto node = record_batch.read<ArrowFieldNode>(nodes + sizeof(ArrowFieldNode) * node_index[c]);
+            if (node.length < 0 || node.length > int64_t(data.size()))
+                throw std::runtime_error("read_arrow: corrupt record batch");
+            if (node.null_count != 0)
+                throw std::runtime_error("read_arrow: columns with nulls aren't supported");
+
+            ArrowChunk chunk{size_t(node.length), {}};
+            for (size_t i = 0; i < n; ++i) {
+                auto buffer = record_batch.read<ArrowBuffer>(buffers + sizeof(ArrowBuffer) * (buffer_index[c] + i));
+                if (buffer.offset < 0 || buffer.length < 0 || buffer.offset + buffer.length > block.body_length)
+                    throw std::runtime_error("read_arrow: a buffer lies outside its record batch");
+                chunk.buffers.push_back({int64_t(body + buffer.offset), buffer.length});
+            }
+            columns[c].num_rows += chunk.length;
+            columns[c].chunks.push_back(std::move(chunk));
+        }
+    }
+    if (names.size() == 2 && columns[0].num_rows != columns[1].num_rows)
+        throw std::runtime_error("read_arrow: columns have different lengths");
+    return columns;
+}
+
+// Load a dataframe from an Arrow IPC file. Tag and Value are the types of
+// the dataframe's tags and values, and tag_column and value_column are the
+// names of the columns that hold them. When Tag is RangeTag, the rows are
+// tagged with their position and the file needs no tag column. Like
+// read_binary, integer and floating point columns are loaded as Mapped<T>
+// arrays that point into a memory mapping of the file, and strings are
+// loaded into StringArenas.
+template <typename Tag, typename Value>
+auto read_arrow(const std::string &filename,
+                const std::string &tag_column = "tag",
+                const std::string &value_column = "value") {
+    auto file = std::make_shared<MappedFile>(filename);
+    constexpr bool has_tag_column = !std::is_same_v<Tag, RangeTag>;
+    std::vector<std::string> names = {value_column};
+    if (has_tag_column)
+        names.push_back(tag_column);
+    auto columns = read_arrow_columns(*file, names);
+
+    DataFrame<typename BinaryStorage<Tag>::type, typename BinaryStorage<Value>::type> df;
+    if constexpr (has_tag_column)
+        read_column(file, columns[1], *df.tags);
+    else
+        read_column(columns[0], *df.tags);
+    read_column(file, columns[0], *df.values);
+    return df;
+}
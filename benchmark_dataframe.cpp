@@ -0,0 +1,260 @@
+/*
+Microbenchmarks of the expression operators. Compile with
+
+   clang++ -O2 -std=c++2b benchmark_dataframe.cpp -lbenchmark -lpthread
+
+and run with, for example, --benchmark_filter=Intersection to select
+benchmarks. Each benchmark reports rows/s as items_per_second, and the bytes
+of input it reads per second as bytes_per_second.
+
+The benchmarks sweep the number of rows, the type of the tags (int,
+std::string, and RangeTag, whose tags aren't stored), how many times each tag
+is duplicated, and the fraction of rows a join matches.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "dataframe.h"
+
+// The tag of row i. Strings are zero-padded so they sort like the integers.
+template <typename Tag>
+Tag make_tag(size_t i) {
+    if constexpr (std::is_same_v<Tag, std::string>) {
+        char s[16];
+        std::snprintf(s, sizeof(s), "key%012zu", i);
+        return s;
+    } else
+        return Tag(i);
+}
+
+// The type of the tags of a DataFrame<Tag, ...>.
+template <typename Tag>
+using TagOf = std::conditional_t<std::is_same_v<Tag, RangeTag>, size_t, Tag>;
+
+// A dataframe of n rows whose tags each appear duplication times in a row,
+// and which are spaced stride apart.
+template <typename Tag>
+DataFrame<Tag, double> make_dataframe(size_t n, size_t duplication = 1, size_t stride = 1) {
+    std::vector<double> values(n);
+    for (size_t i = 0; i < n; ++i)
+        values[i] = i % 101;
+    if constexpr (std::is_same_v<Tag, RangeTag>) {
+        return DataFrame<RangeTag, double>({n}, values);
+    } else {
+        std::vector<Tag> tags(n);
+        for (size_t i = 0; i < n; ++i)
+            tags[i] = make_tag<Tag>(i / duplication * stride);
+        return DataFrame<Tag, double>(tags, values);
+    }
+}
+
+// Bytes held by the tags of df, including the characters of string tags.
+template <typename Tag, typename Value>
+size_t tag_bytes(const DataFrame<Tag, Value> &df) {
+    if constexpr (std::is_same_v<Tag, std::string>) {
+        size_t bytes = 0;
+        for (const auto &t : *df.tags)
+            bytes += t.size();
+        return bytes;
+    } else if constexpr (std::is_same_v<Tag, RangeTag>)
+        return 0;
+    else
+        return df.size() * sizeof(Tag);
+}
+
+template <typename Tag, typename Value>
+size_t row_bytes(const DataFrame<Tag, Value> &df) {
+    return tag_bytes(df) + df.size() * sizeof(Value);
+}
+
+// Evaluate every entry of an expression without materializing it. Returns the
+// number of entries.
+template <typename Expr>
+size_t consume(Expr expr) {
+    size_t n = 0;
+    for (; !expr.end(); expr.next()) {
+        benchmark::DoNotOptimize(expr.tag());
+        benchmark::DoNotOptimize(expr.value());
+        n++;
+    }
+    return n;
+}
+
+template <typename Tag, typename Value>
+void set_processed(benchmark::State &state, const DataFrame<Tag, Value> &df) {
+    state.SetItemsProcessed(state.iterations() * df.size());
+    state.SetBytesProcessed(state.iterations() * row_bytes(df));
+}
+
+// Args are (rows).
+static void Sizes(benchmark::internal::Benchmark *b) {
+    for (long n : {1 << 10, 1 << 16, 1 << 20})
+        b->Args({n});
+}
+
+// Args are (rows, duplication).
+static void SizesAndDuplication(benchmark::internal::Benchmark *b) {
+    for (long n : {1 << 10, 1 << 16, 1 << 20})
+        for (long duplication : {1, 16, 256})
+            b->Args({n, duplication});
+}
+
+// Args are (rows, percent of rows that match).
+static void SizesAndSelectivity(benchmark::internal::Benchmark *b) {
+    for (long n : {1 << 10, 1 << 16, 1 << 20})
+        for (long selectivity : {1, 10, 100})
+            b->Args({n, selectivity});
+}
+
+// Traversing a materialized dataframe through Expr_DataFrame.
+template <typename Tag>
+static void BM_DataFrame(benchmark::State &state) {
+    auto df = make_dataframe<Tag>(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(to_expr(df)));
+    set_processed(state, df);
+}
+BENCHMARK_TEMPLATE(BM_DataFrame, int)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_DataFrame, std::string)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_DataFrame, RangeTag)->Apply(Sizes);
+
+// The same element-wise operation as an Expr_Apply and as an Expr_Reduction
+// whose operator isn't a reduction, which Expr_Apply's comment promises to
+// compare.
+template <typename Tag>
+static void BM_Apply(benchmark::State &state) {
+    auto df = make_dataframe<Tag>(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(df.apply([](const auto &, double v) { return 2 * v + 1; })));
+    set_processed(state, df);
+}
+BENCHMARK_TEMPLATE(BM_Apply, int)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_Apply, std::string)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_Apply, RangeTag)->Apply(Sizes);
+
+template <typename Tag>
+static void BM_ReductionAsApply(benchmark::State &state) {
+    auto df = make_dataframe<Tag>(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(df.reduce([](const auto &, double v) { return 2 * v + 1; })));
+    set_processed(state, df);
+}
+BENCHMARK_TEMPLATE(BM_ReductionAsApply, int)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_ReductionAsApply, std::string)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_ReductionAsApply, RangeTag)->Apply(Sizes);
+
+// Expr_Reduction as a group-by, with groups of duplication rows.
+template <typename Tag>
+static void BM_Reduction(benchmark::State &state) {
+    auto df = make_dataframe<Tag>(state.range(0), state.range(1));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(df.reduce_sum()));
+    set_processed(state, df);
+}
+BENCHMARK_TEMPLATE(BM_Reduction, int)->Apply(SizesAndDuplication);
+BENCHMARK_TEMPLATE(BM_Reduction, std::string)->Apply(SizesAndDuplication);
+
+// Expr_Retag onto shuffled keys that each appear duplication times. This
+// includes the argsort of the keys.
+template <typename Tag>
+static void BM_Retag(benchmark::State &state) {
+    size_t n = state.range(0);
+    auto df = make_dataframe<RangeTag>(n);
+    auto keys = make_dataframe<Tag>(n, state.range(1));
+    std::shuffle(keys.tags->begin(), keys.tags->end(), std::mt19937(0));
+    auto new_tags = DataFrame<RangeTag, Tag>({n}, *keys.tags);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(df.retag(new_tags)));
+    set_processed(state, df);
+    state.SetBytesProcessed(state.iterations() * (row_bytes(df) + tag_bytes(keys)));
+}
+BENCHMARK_TEMPLATE(BM_Retag, int)->Apply(SizesAndDuplication);
+BENCHMARK_TEMPLATE(BM_Retag, std::string)->Apply(SizesAndDuplication);
+
+// Expr_Intersection of a dataframe with one whose tags match selectivity
+// percent of its rows.
+template <typename Tag>
+static void BM_Intersection(benchmark::State &state) {
+    size_t n = state.range(0);
+    size_t stride = 100 / state.range(1);
+    auto df = make_dataframe<Tag>(n);
+    auto other = make_dataframe<TagOf<Tag>>(std::max<size_t>(n / stride, 1), 1, stride);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(df.collate(other, [](double a, double b) { return a * b; })));
+    state.SetItemsProcessed(state.iterations() * (df.size() + other.size()));
+    state.SetBytesProcessed(state.iterations() * (row_bytes(df) + row_bytes(other)));
+}
+BENCHMARK_TEMPLATE(BM_Intersection, int)->Apply(SizesAndSelectivity);
+BENCHMARK_TEMPLATE(BM_Intersection, std::string)->Apply(SizesAndSelectivity);
+BENCHMARK_TEMPLATE(BM_Intersection, RangeTag)->Apply(SizesAndSelectivity);
+
+// Expr_Union of two dataframes whose tags interleave.
+template <typename Tag>
+static void BM_Union(benchmark::State &state) {
+    size_t n = state.range(0);
+    auto evens = make_dataframe<Tag>(n / 2, 1, 2);
+    auto odds = make_dataframe<Tag>(n / 2, 1, 2);
+    for (size_t i = 0; i < odds.size(); ++i)
+        (*odds.tags)[i] = make_tag<Tag>(2 * i + 1);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(consume(evens.concatenate(odds)));
+    state.SetItemsProcessed(state.iterations() * n);
+    state.SetBytesProcessed(state.iterations() * (row_bytes(evens) + row_bytes(odds)));
+}
+BENCHMARK_TEMPLATE(BM_Union, int)->Apply(Sizes);
+BENCHMARK_TEMPLATE(BM_Union, std::string)->Apply(Sizes);
+
+// argsort of shuffled keys that each appear duplication times.
+template <typename Tag>
+static void BM_Argsort(benchmark::State &state) {
+    auto keys = make_dataframe<Tag>(state.range(0), state.range(1));
+    std::shuffle(keys.tags->begin(), keys.tags->end(), std::mt19937(0));
+    for (auto _ : state) {
+        std::vector<size_t> order;
+        argsort(*keys.tags, order);
+        benchmark::DoNotOptimize(order.data());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    state.SetBytesProcessed(state.iterations() * tag_bytes(keys));
+}
+BENCHMARK_TEMPLATE(BM_Argsort, int)->Apply(SizesAndDuplication);
+BENCHMARK_TEMPLATE(BM_Argsort, std::string)->Apply(SizesAndDuplication);
+
+struct Record {
+    std::string name;
+    int count;
+    double score;
+};
+
+void from_tab_separated_string(Record &r, const std::string_view &s) {
+    parse_tab_separated_string(s, r.name, r.count, r.score);
+}
+
+// read_tsv of a file of records with a string and two numbers.
+static void BM_ReadTsv(benchmark::State &state) {
+    size_t n = state.range(0);
+    std::string filename = "/tmp/benchmark_dataframe_" + std::to_string(n) + ".tsv";
+    {
+        std::ofstream f(filename);
+        f << "name\tcount\tscore\n";
+        for (size_t i = 0; i < n; ++i)
+            f << "record" << i << '\t' << i % 1000 << '\t' << i * 0.25 << '\n';
+    }
+    size_t file_bytes = std::ifstream(filename, std::ios::ate | std::ios::binary).tellg();
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(read_tsv<Record>(filename).size());
+    state.SetItemsProcessed(state.iterations() * n);
+    state.SetBytesProcessed(state.iterations() * file_bytes);
+    std::remove(filename.c_str());
+}
+BENCHMARK(BM_ReadTsv)->Apply(Sizes);
+
+BENCHMARK_MAIN();
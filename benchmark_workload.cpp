@@ -0,0 +1,301 @@
+/*
+End-to-end benchmark of the pipelines in the README and the GameDemo test, on
+synthetic datasets whose keys follow a Zipf distribution, the way servers and
+players in real logs do. Compile with
+
+   clang++ -O2 -std=c++2b benchmark_workload.cpp -lpthread
+
+and run with
+
+   ./a.out --rows=10000000,100000000 --keys=1000 --skew=1.1 > workload.json
+
+Each pipeline runs once with dataframes and once as a hand-written loop over
+std::maps, like GameDemo.native. The program prints one JSON object with a
+record per pipeline, implementation, and number of rows, so results can be
+collected and compared over time. The dataframe records include the time spent
+in each ProfileZone.
+
+A billion rows of Tasks take over 100GB of memory, so pass sizes that fit.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "dataframe.h"
+
+enum class TaskType { compute, io, network };
+
+// The Task dataset of the README.
+struct Task {
+    std::string server_id;
+    std::string jobid;
+    std::string origin;
+    float task_duration;
+    float resource_consumed;
+    TaskType kind;
+};
+
+// The matches of the GameDemo test.
+struct Game {
+    std::string player1;
+    std::string player2;
+    int score_player1;
+    int score_player2;
+};
+
+// Draws ranks 0...num_keys-1, where rank k has probability proportional to
+// 1/(k+1)^skew. Samples by binary search of the cumulative distribution.
+struct ZipfDistribution {
+    std::vector<double> cdf;
+
+    ZipfDistribution(size_t num_keys, double skew) : cdf(num_keys) {
+        double total = 0;
+        for (size_t k = 0; k < num_keys; ++k)
+            cdf[k] = total += std::pow(k + 1., -skew);
+        for (double &c : cdf)
+            c /= total;
+    }
+
+    template <typename Rng>
+    size_t operator()(Rng &rng) {
+        double u = std::uniform_real_distribution<double>()(rng);
+        return std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    }
+};
+
+// Names for the keys. The ranks are shuffled so that the popular keys are
+// spread out in sorted order rather than clustered at the front.
+std::vector<std::string> key_names(const std::string &prefix, size_t num_keys, std::mt19937_64 &rng) {
+    std::vector<std::string> names(num_keys);
+    for (size_t k = 0; k < num_keys; ++k)
+        names[k] = prefix + std::to_string(k);
+    std::shuffle(names.begin(), names.end(), rng);
+    return names;
+}
+
+DataFrame<RangeTag, Task> make_tasks(size_t num_rows, size_t num_servers, double skew, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    auto servers = key_names("server", num_servers, rng);
+    ZipfDistribution server(num_servers, skew);
+    std::exponential_distribution<float> duration(1.f / 30);
+    std::uniform_real_distribution<float> resource(0, 1);
+    const char *origins[] = {"us-east", "us-west", "eu", "asia"};
+
+    DataFrame<RangeTag, Task> tasks;
+    tasks.values->reserve(num_rows);
+    for (size_t i = 0; i < num_rows; ++i)
+        tasks.values->push_back(Task{
+            .server_id = servers[server(rng)],
+            .jobid = "job" + std::to_string(i / 16),
+            .origin = origins[rng() % 4],
+            .task_duration = duration(rng),
+            .resource_consumed = resource(rng),
+            .kind = TaskType(rng() % 3),
+        });
+    tasks.tags->sz = num_rows;
+    return tasks;
+}
+
+DataFrame<RangeTag, Game> make_matches(size_t num_rows, size_t num_players, double skew, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    auto players = key_names("player", num_players, rng);
+    ZipfDistribution player(num_players, skew);
+    std::uniform_int_distribution<int> score(0, 20);
+
+    DataFrame<RangeTag, Game> matches;
+    matches.values->reserve(num_rows);
+    for (size_t i = 0; i < num_rows; ++i) {
+        size_t p1 = player(rng), p2 = player(rng);
+        if (p1 == p2)
+            p2 = (p2 + 1) % num_players;
+        matches.values->push_back(Game{players[p1], players[p2], score(rng), score(rng)});
+    }
+    matches.tags->sz = num_rows;
+    return matches;
+}
+
+// The pipelines, with dataframes and natively. Both return a map from key to
+// result so they can be checked against each other.
+
+std::map<std::string, float> average_duration_by_server(DataFrame<RangeTag, Task> &tasks) {
+    ProfileZone zone("average_duration_by_server");
+    auto task_duration_by_server = tasks.apply([](const Task &t) { return t.task_duration; })
+                                       .retag(tasks.apply([](const Task &t) { return t.server_id; }));
+    auto average = *task_duration_by_server.reduce_mean();
+
+    std::map<std::string, float> result;
+    for (size_t i = 0; i < average.size(); ++i)
+        result.emplace((*average.tags)[i], (*average.values)[i]);
+    return result;
+}
+
+std::map<std::string, float> average_duration_by_server_native(const DataFrame<RangeTag, Task> &tasks) {
+    std::map<std::string, std::pair<float, size_t>> sums;
+    for (const Task &t : *tasks.values) {
+        auto &[sum, count] = sums[t.server_id];
+        sum += t.task_duration;
+        count++;
+    }
+    std::map<std::string, float> result;
+    for (const auto &[server, sum_count] : sums)
+        result[server] = sum_count.first / sum_count.second;
+    return result;
+}
+
+std::map<std::string, float> win_rate(DataFrame<RangeTag, Game> &matches) {
+    ProfileZone zone("win_rate");
+    auto num_games_won =
+        *matches([](const Game &m) { return m.score_player1 > m.score_player2 ? m.player1 : m.player2; })
+             .materialize()
+             .count_values();
+
+    auto num_games_played = matches([](const Game &m) { return m.player1; })
+                                .concatenate(matches([](const Game &m) { return m.player2; }))
+                                .materialize()
+                                .count_values();
+
+    auto rate = *num_games_won.collate(num_games_played, [](int wins, int games) { return float(wins) / games; });
+
+    std::map<std::string, float> result;
+    for (size_t i = 0; i < rate.size(); ++i)
+        result.emplace((*rate.tags)[i], (*rate.values)[i]);
+    return result;
+}
+
+std::map<std::string, float> win_rate_native(const DataFrame<RangeTag, Game> &matches) {
+    std::map<std::string, int> num_games_won;
+    for (const Game &m : *matches.values) {
+        const std::string &winner = m.score_player1 > m.score_player2 ? m.player1 : m.player2;
+        num_games_won[winner] += 1;
+    }
+
+    std::map<std::string, int> num_games_played;
+    for (const Game &m : *matches.values) {
+        num_games_played[m.player1] += 1;
+        num_games_played[m.player2] += 1;
+    }
+
+    std::map<std::string, float> result;
+    for (auto [player, won] : num_games_won)
+        result[player] = float(won) / num_games_played[player];
+    return result;
+}
+
+// Whether two results have the same keys and nearly the same values. The
+// implementations sum in different orders and precisions.
+bool same_results(const std::map<std::string, float> &a, const std::map<std::string, float> &b) {
+    if (a.size() != b.size())
+        return false;
+    for (auto i = a.begin(), j = b.begin(); i != a.end(); ++i, ++j)
+        if (i->first != j->first || std::abs(i->second - j->second) > 1e-3 * std::max(1.f, std::abs(i->second)))
+            return false;
+    return true;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+struct Options {
+    std::vector<size_t> rows = {10000000};
+    size_t keys = 1000;
+    double skew = 1.1;
+    uint64_t seed = 0;
+};
+
+Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--rows") {
+            options.rows.clear();
+            std::istringstream s(value);
+            for (std::string n; std::getline(s, n, ',');)
+                options.rows.push_back(std::stoull(n));
+        } else if (name == "--keys")
+            options.keys = std::stoull(value);
+        else if (name == "--skew")
+            options.skew = std::stod(value);
+        else if (name == "--seed")
+            options.seed = std::stoull(value);
+        else
+            throw std::invalid_argument("unknown option " + arg +
+                                        ". Options are --rows=N[,N...], --keys=N, --skew=S, and --seed=N.");
+    }
+    return options;
+}
+
+// Time the dataframe and native implementations of a pipeline on a dataset,
+// and print their records.
+template <typename Dataset, typename Pipeline, typename Native>
+void run(const char *workload, const Options &options, size_t num_rows, double generate_seconds, Dataset &dataset,
+         Pipeline pipeline, Native native, bool &first) {
+    auto &profiler = Profiler::global();
+    profiler.reset();
+    profiler.enable();
+    auto t_start = std::chrono::steady_clock::now();
+    auto result = pipeline(dataset);
+    double dataframe_seconds = seconds_since(t_start);
+    profiler.disable();
+    auto profile = profiler.tree().json();
+
+    t_start = std::chrono::steady_clock::now();
+    auto expected = native(dataset);
+    double native_seconds = seconds_since(t_start);
+    bool match = same_results(result, expected);
+
+    for (auto [implementation, seconds, groups] :
+         {std::tuple("dataframe", dataframe_seconds, result.size()), {"native", native_seconds, expected.size()}}) {
+        std::cout << (first ? "\n" : ",\n") << "    {\"workload\": \"" << workload << "\", \"implementation\": \""
+                  << implementation << "\", \"rows\": " << num_rows << ", \"keys\": " << options.keys
+                  << ", \"skew\": " << options.skew << ", \"seed\": " << options.seed
+                  << ", \"generate_seconds\": " << generate_seconds << ", \"seconds\": " << seconds
+                  << ", \"rows_per_second\": " << num_rows / seconds << ", \"groups\": " << groups
+                  << ", \"results_match\": " << (match ? "true" : "false");
+        if (implementation == std::string("dataframe"))
+            std::cout << ", \"profile\": " << profile;
+        std::cout << "}" << std::flush;
+        first = false;
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 2;
+    }
+
+    bool first = true;
+    std::cout << "{\"results\": [";
+    for (size_t num_rows : options.rows) {
+        {
+            auto t_start = std::chrono::steady_clock::now();
+            auto tasks = make_tasks(num_rows, options.keys, options.skew, options.seed);
+            double generate_seconds = seconds_since(t_start);
+            run("average_duration_by_server", options, num_rows, generate_seconds, tasks, average_duration_by_server,
+                average_duration_by_server_native, first);
+        }
+        {
+            auto t_start = std::chrono::steady_clock::now();
+            auto matches = make_matches(num_rows, options.keys, options.skew, options.seed);
+            double generate_seconds = seconds_since(t_start);
+            run("win_rate", options, num_rows, generate_seconds, matches, win_rate, win_rate_native, first);
+        }
+    }
+    std::cout << "\n]}\n";
+}
@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+// A native binary file format for dataframes.
+//
+// The file starts with a BinaryHeader, followed by a section for the tags and
+// a section for the values. Each section starts at a multiple of 64 bytes and
+// carries its own checksum. Arrays of trivially copyable types are stored as
+// is, so they can be used straight from a memory mapping of the file. Arrays
+// of strings are stored as num_rows + 1 uint64 offsets followed by the bytes
+// of the strings. RangeTags take no space.
+//
+// Those are the only types a column can have. A struct with a string member,
+// or any other type that isn't trivially copyable, can't be written. Store
+// its members as separate dataframes that share a RangeTag instead.
+
+// Marks an array of trivially copyable values that lives in a memory mapped
+// file. See std::vector<Mapped<T>>.
+template <typename _T>
+struct Mapped {};
+
+// A read-only std::vector whose entries are stored in a memory mapped file.
+// The mapping stays alive as long as any array refers to it. Entries that
+// couldn't be used from the mapping, like the entries of a column that's
+// split over several record batches of an Arrow file, are held in copy.
+template <typename T>
+struct std::vector<Mapped<T>> {
+    using value_type = T;
+
+    std::shared_ptr<MappedFile> file;
+    std::shared_ptr<const std::vector<T>> copy;
+    const T *entries;
+    size_t sz;
+
+    vector() : entries(nullptr), sz(0) {}
+    vector(std::shared_ptr<MappedFile> _file, size_t offset, size_t _sz)
+        : file(_file), entries(reinterpret_cast<const T *>(_file->data + offset)), sz(_sz) {}
+    vector(std::vector<T> _copy)
+        : copy(std::make_shared<const std::vector<T>>(std::move(_copy))), entries(copy->data()), sz(copy->size()) {}
+
+    size_t size() const { return sz; }
+    const T &operator[](size_t i) const { return entries[i]; }
+    const T *begin() const { return entries; }
+    const T *end() const { return entries + sz; }
+};
+
+// The mapping belongs to the page cache rather than to this process's heap.
+template <typename T>
+size_t storage_bytes(const std::vector<Mapped<T>> &v) {
+    return sizeof(v) + (v.copy ? storage_bytes(*v.copy) : 0);
+}
+
+enum class BinaryColumnKind : uint32_t { Range = 0, Fixed = 1, Strings = 2 };
+
+struct BinaryColumnHeader {
+    BinaryColumnKind kind;
+    uint32_t element_size;
+    uint64_t type_hash;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_rows;
+    BinaryColumnHeader tags;
+    BinaryColumnHeader values;
+};
+
+constexpr char binary_magic[8] = {'D', 'F', 'R', 'A', 'M', 'E', '\0', '\1'};
+constexpr uint32_t binary_version = 1;
+constexpr uint32_t binary_byte_order = 0x01020304;
+constexpr size_t binary_alignment = 64;
+
+// A fast 64-bit checksum that can be computed incrementally. Mixes 8 bytes at
+// a time into four independent lanes so it runs at memory bandwidth.
+struct Checksum {
+    static constexpr uint64_t prime = 0x9E3779B97F4A7C15ull;
+
+    uint64_t lanes[4] = {prime, ~prime, 3 * prime, ~(3 * prime)};
+    char pending[32];
+    size_t num_pending = 0;
+    uint64_t size = 0;
+
+    void mix(const char *block) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            std::memcpy(&word, block + 8 * lane, 8);
+            lanes[lane] = (lanes[lane] ^ word) * prime;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+
+    Checksum &update(const char *data, size_t n) {
+        size += n;
+        if (num_pending) {
+            size_t k = std::min(sizeof(pending) - num_pending, n);
+            std::memcpy(pending + num_pending, data, k);
+            num_pending += k;
+            data += k;
+            n -= k;
+            if (num_pending < sizeof(pending))
+                return *this;
+            mix(pending);
+            num_pending = 0;
+        }
+        for (; n >= sizeof(pending); data += sizeof(pending), n -= sizeof(pending))
+            mix(data);
+        std::memcpy(pending, data, n);
+        num_pending = n;
+        return *this;
+    }
+
+    uint64_t finish() const {
+        uint64_t h = size;
+        for (uint64_t lane : lanes)
+            h = (h ^ lane) * prime;
+        for (size_t i = 0; i < num_pending; ++i)
+            h = (h ^ uint8_t(pending[i])) * prime;
+        return h ^ (h >> 32);
+    }
+};
+
+inline uint64_t checksum(const char *data, size_t size) { return Checksum().update(data, size).finish(); }
+
+// Identifies the type of the entries of a column in the file header. Uses
+// the compiler's name for the type, which only needs to be stable between the
+// writer and the reader.
+template <typename T>
+uint64_t binary_type_hash() {
+    const char *name = std::is_same_v<T, std::string> ? "string" : typeid(T).name();
+    return checksum(name, std::strlen(name));
+}
+
+// Writes the sections of a binary file and tracks the current offset.
+struct BinaryWriter {
+    FILE *f;
+    uint64_t offset;
+
+    void write(const void *data, size_t size) {
+        if (size && std::fwrite(data, 1, size, f) != size)
+            throw std::system_error(errno, std::system_category(), "write_binary");
+        offset += size;
+    }
+
+    void pad_to_alignment() {
+        static const char zeros[binary_alignment] = {};
+        write(zeros, (binary_alignment - offset % binary_alignment) % binary_alignment);
+    }
+};
+
+// Each storage type writes its column with write_column and reads it back
+// with read_column. BinaryStorage names the storage a column is read into.
+template <typename T>
+struct BinaryStorage {
+    static_assert(std::is_trivially_copyable_v<T>, "write_binary only supports trivially copyable types and strings");
+    using type = Mapped<T>;
+};
+
+template <>
+struct BinaryStorage<RangeTag> {
+    using type = RangeTag;
+};
+
+template <>
+struct BinaryStorage<std::string> {
+    using type = StringArena;
+};
+
+template <>
+struct BinaryStorage<StringArena> {
+    using type = StringArena;
+};
+
+template <typename T>
+struct BinaryStorage<Mapped<T>> {
+    using type = Mapped<T>;
+};
+
+inline void write_column(BinaryWriter &, const std::vector<RangeTag> &, BinaryColumnHeader &column) {
+    column.kind = BinaryColumnKind::Range;
+}
+
+template <typename T>
+void write_fixed_column(BinaryWriter &w, const T *entries, size_t size, BinaryColumnHeader &column) {
+    column.kind = BinaryColumnKind::Fixed;
+    column.element_size = sizeof(T);
+    column.type_hash = binary_type_hash<T>();
+    column.offset = w.offset;
+    column.size = size * sizeof(T);
+    column.checksum = checksum(reinterpret_cast<const char *>(entries), column.size);
+    w.write(entries, column.size);
+}
+
+template <typename T>
+void write_column(BinaryWriter &w, const std::vector<T> &v, BinaryColumnHeader &column) {
+    static_assert(std::is_trivially_copyable_v<T>, "write_binary only supports trivially copyable types and strings");
+    write_fixed_column(w, v.data(), v.size(), column);
+}
+
+template <typename T>
+void write_column(BinaryWriter &w, const std::vector<Mapped<T>> &v, BinaryColumnHeader &column) {
+    write_fixed_column(w, v.entries, v.size(), column);
+}
+
+// Strings are written as offsets followed by bytes. get(i) returns the i'th
+// string as a string_view.
+template <typename GetString>
+void write_strings_column(BinaryWriter &w, size_t size, GetString get, BinaryColumnHeader &column) {
+    std::vector<uint64_t> offsets(size + 1, 0);
+    for (size_t i = 0; i < size; ++i)
+        offsets[i + 1] = offsets[i] + get(i).size();
+
+    column.kind = BinaryColumnKind::Strings;
+    column.element_size = 0;
+    column.type_hash = binary_type_hash<std::string>();
+    column.offset = w.offset;
+    column.size = offsets.size() * sizeof(uint64_t) + offsets.back();
+
+    Checksum c;
+    c.update(reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    w.write(offsets.data(), offsets.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < size; ++i) {
+        std::string_view s = get(i);
+        c.update(s.data(), s.size());
+        w.write(s.data(), s.size());
+    }
+    column.checksum = c.finish();
+}
+
+inline void write_column(BinaryWriter &w, const std::vector<std::string> &v, BinaryColumnHeader &column) {
+    write_strings_column(w, v.size(), [&v](size_t i) { return std::string_view(v[i]); }, column);
+}
+
+inline void write_column(BinaryWriter &w, const std::vector<StringArena> &v, BinaryColumnHeader &column) {
+    write_strings_column(w, v.size(), [&v](size_t i) { return v[i]; }, column);
+}
+
+// Checks that a column of the file matches the type it's read as.
+template <typename T>
+void check_column(const MappedFile &file, const BinaryColumnHeader &column, BinaryColumnKind kind,
+                  bool verify_checksum) {
+    if (column.kind != kind)
+        throw std::runtime_error("read_binary: the file stores a different kind of column");
+    if (kind == BinaryColumnKind::Range)
+        return;
+    if (column.type_hash != binary_type_hash<T>() ||
+        (kind == BinaryColumnKind::Fixed && column.element_size != sizeof(T)))
+        throw std::runtime_error("read_binary: the file stores a column of a different type");
+    if (column.offset % binary_alignment || column.offset + column.size > file.size)
+        throw std::runtime_error("read_binary: the file is truncated");
+    if (verify_checksum && checksum(file.data + column.offset, column.size) != column.checksum)
+        throw std::runtime_error("read_binary: checksum mismatch");
+}
+
+inline void read_column(std::shared_ptr<MappedFile> file, const BinaryHeader &header,
+                        const BinaryColumnHeader &column, std::vector<RangeTag> &v, bool verify_checksum) {
+    check_column<RangeTag>(*file, column, BinaryColumnKind::Range, verify_checksum);
+    v.sz = header.num_rows;
+}
+
+// Trivially copyable columns aren't copied. The array points into the mapping.
+template <typename T>
+void read_column(std::shared_ptr<MappedFile> file, const BinaryHeader &header, const BinaryColumnHeader &column,
+                 std::vector<Mapped<T>> &v, bool verify_checksum) {
+    check_column<T>(*file, column, BinaryColumnKind::Fixed, verify_checksum);
+    if (column.size != header.num_rows * sizeof(T))
+        throw std::runtime_error("read_binary: column size doesn't match the number of rows");
+    v = std::vector<Mapped<T>>(file, column.offset, header.num_rows);
+}
+
+// Strings are decoded into a StringArena with two copies: one for the offsets
+// and one for the bytes.
+inline void read_column(std::shared_ptr<MappedFile> file, const BinaryHeader &header,
+                        const BinaryColumnHeader &column, std::vector<StringArena> &v, bool verify_checksum) {
+    check_column<std::string>(*file, column, BinaryColumnKind::Strings, verify_checksum);
+    auto offsets = reinterpret_cast<const uint64_t *>(file->data + column.offset);
+    if (header.num_rows >= column.size / sizeof(uint64_t))
+        throw std::runtime_error("read_binary: column size doesn't match its strings");
+    size_t offsets_size = (header.num_rows + 1) * sizeof(uint64_t);
+    if (column.size - offsets_size != offsets[header.num_rows])
+        throw std::runtime_error("read_binary: column size doesn't match its strings");
+
+    // Without checksums, corrupt offsets could point outside the column, so
+    // they're checked either way.
+    if (offsets[0] != 0)
+        throw std::runtime_error("read_binary: corrupt string offsets");
+    for (size_t i = 0; i < header.num_rows; ++i)
+        if (offsets[i] > offsets[i + 1])
+            throw std::runtime_error("read_binary: corrupt string offsets");
+
+    v.offsets.assign(offsets, offsets + header.num_rows + 1);
+    v.bytes.assign(file->data + column.offset + offsets_size, offsets[header.num_rows]);
+}
+
+// Write a materialized dataframe in binary format to f, which must be at its
+// start. The header goes last, so a reader that sees a valid header sees the
+// whole dataframe. filename is for error messages.
+template <typename Tag, typename Value>
+void write_binary(const DataFrame<Tag, Value> &df, FILE *f, const std::string &filename) {
+    BinaryHeader header = {};
+    std::memcpy(header.magic, binary_magic, sizeof(binary_magic));
+    header.version = binary_version;
+    header.byte_order = binary_byte_order;
+    header.num_rows = df.size();
+
+    // Reserve room for the header, then write the sections, then go back and
+    // fill in the header.
+    BinaryWriter w{f, 0};
+    BinaryHeader blank = {};
+    w.write(&blank, sizeof(blank));
+    w.pad_to_alignment();
+    write_column(w, *df.tags, header.tags);
+    w.pad_to_alignment();
+    write_column(w, *df.values, header.values);
+
+    if (std::fflush(f) != 0 || std::fseek(f, 0, SEEK_SET) != 0)
+        throw std::system_error(errno, std::system_category(), filename);
+    w.write(&header, sizeof(header));
+    if (std::fflush(f) != 0)
+        throw std::system_error(errno, std::system_category(), filename);
+}
+
+// Write a materialized dataframe to a binary file.
+template <typename Tag, typename Value>
+void write_binary(const DataFrame<Tag, Value> &df, const std::string &filename) {
+    auto f = std::unique_ptr<FILE, decltype(&std::fclose)>(std::fopen(filename.c_str(), "wb"), &std::fclose);
+    if (!f)
+        throw std::system_error(errno, std::system_category(), filename);
+    write_binary(df, f.get(), filename);
+    if (std::fclose(f.release()) != 0)
+        throw std::system_error(errno, std::system_category(), filename);
+}
+
+// Load a dataframe written by write_binary. Tag and Value are the storage
+// types the dataframe was written with. Trivially copyable tags and values
+// are loaded without copying as Mapped<T> arrays that point into a memory
+// mapping of the file. Strings are loaded into StringArenas.
+template <typename Tag, typename Value>
+auto read_binary(std::shared_ptr<MappedFile> file, const std::string &filename, bool verify_checksums = true) {
+    if (verify_checksums)
+        file->prefetch();
+    if (file->size < sizeof(BinaryHeader))
+        throw std::runtime_error("read_binary: " + filename + " is too short to be a binary dataframe");
+
+    BinaryHeader header;
+    std::memcpy(&header, file->data, sizeof(header));
+    if (std::memcmp(header.magic, binary_magic, sizeof(binary_magic)) != 0)
+        throw std::runtime_error("read_binary: " + filename + " is not a binary dataframe");
+    if (header.version != binary_version || header.byte_order != binary_byte_order)
+        throw std::runtime_error("read_binary: " + filename + " has an unsupported version or byte order");
+
+    DataFrame<typename BinaryStorage<Tag>::type, typename BinaryStorage<Value>::type> df;
+    read_column(file, header, header.tags, *df.tags, verify_checksums);
+    read_column(file, header, header.values, *df.values, verify_checksums);
+    return df;
+}
+
+template <typename Tag, typename Value>
+auto read_binary(const std::string &filename, bool verify_checksums = true) {
+    return read_binary<Tag, Value>(std::make_shared<MappedFile>(filename), filename, verify_checksums);
+}
@@ -0,0 +1,434 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef DATAFRAME_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef DATAFRAME_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// A compressed variant of the binary file format, for dataframes that are
+// loaded from slow disks.
+//
+// Each array of a column (the entries of a fixed width column, or the offsets
+// and the bytes of a string column) is cut into chunks of chunk_size bytes
+// that are compressed independently. A directory at the end of the file lists
+// every chunk with its place in the file, its place in the array, and a
+// checksum of its compressed bytes. Chunks are compressed and decompressed on
+// several threads, and are decompressed straight into preallocated arrays.
+//
+// LZ4 is fast and Zstd compresses better. They're only available when
+// DATAFRAME_WITH_LZ4 and DATAFRAME_WITH_ZSTD are defined before including
+// dataframe.h, and the program is linked with -llz4 and -lzstd.
+
+enum class Compression : uint32_t { None = 0, LZ4 = 1, Zstd = 2 };
+
+struct CompressedChunk {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t array_offset;
+    uint64_t array_size;
+    uint64_t checksum;
+};
+
+// An array of a column, and the chunks of the directory that hold it.
+struct CompressedArray {
+    uint64_t size;
+    uint64_t first_chunk;
+    uint64_t num_chunks;
+};
+
+struct CompressedColumnHeader {
+    BinaryColumnKind kind;
+    uint32_t element_size;
+    uint64_t type_hash;
+    CompressedArray arrays[2];
+};
+
+struct CompressedHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_rows;
+    Compression compression;
+    uint32_t padding;
+    uint64_t directory_offset;
+    uint64_t num_chunks;
+    CompressedColumnHeader tags;
+    CompressedColumnHeader values;
+};
+
+constexpr char compressed_magic[8] = {'D', 'F', 'R', 'A', 'M', 'E', 'Z', '\1'};
+constexpr uint32_t compressed_version = 1;
+
+// The largest size that size bytes can compress to.
+inline size_t compress_bound(Compression compression, size_t size) {
+    switch (compression) {
+        case Compression::None:
+            return size;
+#ifdef DATAFRAME_WITH_LZ4
+        case Compression::LZ4:
+            return LZ4_compressBound(size);
+#endif
+#ifdef DATAFRAME_WITH_ZSTD
+        case Compression::Zstd:
+            return ZSTD_compressBound(size);
+#endif
+        default:
+            throw std::runtime_error("this program was built without support for the requested compression");
+    }
+}
+
+// Compress size bytes from src into dst, which has room for
+// compress_bound(compression, size) bytes. Returns the compressed size.
+// level is Zstd's compression level, and LZ4's acceleration.
+inline size_t compress(Compression compression, [[maybe_unused]] int level, const char *src, size_t size, char *dst) {
+    switch (compression) {
+        case Compression::None:
+            std::memcpy(dst, src, size);
+            return size;
+#ifdef DATAFRAME_WITH_LZ4
+        case Compression::LZ4: {
+            int n = LZ4_compress_fast(src, dst, size, LZ4_compressBound(size), std::max(level, 1));
+            if (n <= 0)
+                throw std::runtime_error("LZ4 compression failed");
+            return n;
+        }
+#endif
+#ifdef DATAFRAME_WITH_ZSTD
+        case Compression::Zstd: {
+            size_t n = ZSTD_compress(dst, ZSTD_compressBound(size), src, size, level);
+            if (ZSTD_isError(n))
+                throw std::runtime_error(std::string("Zstd compression failed: ") + ZSTD_getErrorName(n));
+            return n;
+        }
+#endif
+        default:
+            throw std::runtime_error("this program was built without support for the requested compression");
+    }
+}
+
+// Decompress size bytes from src into the raw_size bytes at dst.
+inline void decompress(Compression compression, const char *src, size_t size, char *dst, size_t raw_size) {
+    bool ok = false;
+    switch (compression) {
+        case Compression::None:
+            ok = size == raw_size;
+            if (ok)
+                std::memcpy(dst, src, size);
+            break;
+#ifdef DATAFRAME_WITH_LZ4
+        case Compression::LZ4:
+            ok = LZ4_decompress_safe(src, dst, size, raw_size) == int(raw_size);
+            break;
+#endif
+#ifdef DATAFRAME_WITH_ZSTD
+        case Compression::Zstd:
+            ok = ZSTD_decompress(dst, raw_size, src, size) == raw_size;
+            break;
+#endif
+        default:
+            throw std::runtime_error("this program was built without support for the requested compression");
+    }
+    if (!ok)
+        throw std::runtime_error("read_compressed: a chunk doesn't decompress to its size");
+}
+
+// Each storage type lists the arrays of its column with compressed_arrays,
+// and names the storage its column is read into with CompressedStorage. Arrays
+// that have to be computed are kept in scratch.
+template <typename T>
+struct CompressedStorage {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "write_compressed only supports trivially copyable types and strings");
+    using type = T;
+};
+
+template <>
+struct CompressedStorage<RangeTag> {
+    using type = RangeTag;
+};
+
+template <>
+struct CompressedStorage<std::string> {
+    using type = StringArena;
+};
+
+template <>
+struct CompressedStorage<StringArena> {
+    using type = StringArena;
+};
+
+template <typename T>
+struct CompressedStorage<Mapped<T>> {
+    using type = T;
+};
+
+inline std::vector<std::string_view> compressed_arrays(const std::vector<RangeTag> &, CompressedColumnHeader &column,
+                                                       std::deque<std::string> &) {
+    column.kind = BinaryColumnKind::Range;
+    return {};
+}
+
+template <typename T>
+std::vector<std::string_view> compressed_fixed_arrays(const T *entries, size_t size, CompressedColumnHeader &column) {
+    column.kind = BinaryColumnKind::Fixed;
+    column.element_size = sizeof(T);
+    column.type_hash = binary_type_hash<T>();
+    return {std::string_view(reinterpret_cast<const char *>(entries), size * sizeof(T))};
+}
+
+template <typename T>
+std::vector<std::string_view> compressed_arrays(const std::vector<T> &v, CompressedColumnHeader &column,
+                                                std::deque<std::string> &) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "write_compressed only supports trivially copyable types and strings");
+    return compressed_fixed_arrays(v.data(), v.size(), column);
+}
+
+template <typename T>
+std::vector<std::string_view> compressed_arrays(const std::vector<Mapped<T>> &v, CompressedColumnHeader &column,
+                                                std::deque<std::string> &) {
+    return compressed_fixed_arrays(v.entries, v.size(), column);
+}
+
+// Strings are stored like in binary files: num_rows + 1 uint64 offsets,
+// then the bytes of the strings.
+inline std::vector<std::string_view> compressed_arrays(const std::vector<StringArena> &v,
+                                                       CompressedColumnHeader &column, std::deque<std::string> &) {
+    column.kind = BinaryColumnKind::Strings;
+    column.type_hash = binary_type_hash<std::string>();
+    return {std::string_view(reinterpret_cast<const char *>(v.offsets.data()), v.offsets.size() * sizeof(size_t)),
+            v.bytes};
+}
+
+inline std::vector<std::string_view> compressed_arrays(const std::vector<std::string> &v,
+                                                       CompressedColumnHeader &column,
+                                                       std::deque<std::string> &scratch) {
+    column.kind = BinaryColumnKind::Strings;
+    column.type_hash = binary_type_hash<std::string>();
+    auto &offsets = scratch.emplace_back((v.size() + 1) * sizeof(uint64_t), '\0');
+    auto &bytes = scratch.emplace_back();
+    for (size_t i = 0; i < v.size(); ++i) {
+        bytes += v[i];
+        uint64_t offset = bytes.size();
+        std::memcpy(&offsets[(i + 1) * sizeof(uint64_t)], &offset, sizeof(offset));
+    }
+    return {offsets, bytes};
+}
+
+// Write a materialized dataframe to a compressed file. level is Zstd's
+// compression level, or LZ4's acceleration.
+template <typename Tag, typename Value>
+void write_compressed(const DataFrame<Tag, Value> &df,
+                      const std::string &filename,
+                      Compression compression,
+                      int level = 1,
+                      size_t chunk_size = 1 << 20,
+                      size_t num_threads = default_executor().concurrency()) {
+    auto f = std::unique_ptr<FILE, decltype(&std::fclose)>(std::fopen(filename.c_str(), "wb"), &std::fclose);
+    if (!f)
+        throw std::system_error(errno, std::system_category(), filename);
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    num_threads = std::max<size_t>(num_threads, 1);
+
+    CompressedHeader header = {};
+    std::memcpy(header.magic, compressed_magic, sizeof(compressed_magic));
+    header.version = compressed_version;
+    header.byte_order = binary_byte_order;
+    header.num_rows = df.size();
+    header.compression = compression;
+
+    // Cut the arrays of both columns into chunks.
+    std::deque<std::string> scratch;
+    std::vector<std::string_view> chunks;
+    std::vector<CompressedChunk> directory;
+    auto add_column = [&](std::vector<std::string_view> arrays, CompressedColumnHeader &column) {
+        for (size_t a = 0; a < arrays.size(); ++a) {
+            column.arrays[a] = {arrays[a].size(), directory.size(), 0};
+            for (size_t offset = 0; offset < arrays[a].size(); offset += chunk_size) {
+                chunks.push_back(arrays[a].substr(offset, chunk_size));
+                directory.push_back({0, 0, offset, chunks.back().size(), 0});
+                column.arrays[a].num_chunks++;
+            }
+        }
+    };
+    add_column(compressed_arrays(*df.tags, header.tags, scratch), header.tags);
+    add_column(compressed_arrays(*df.values, header.values, scratch), header.values);
+
+    BinaryWriter w{f.get(), 0};
+    w.write(&header, sizeof(header));
+
+    // Compress a few chunks per thread at a time, then write them in order.
+    std::vector<std::string> compressed(4 * num_threads);
+    for (size_t begin = 0; begin < chunks.size(); begin += compressed.size()) {
+        size_t end = std::min(chunks.size(), begin + compressed.size());
+        parallel_for_each_index(end - begin, num_threads, [&](size_t i) {
+            std::string_view chunk = chunks[begin + i];
+            compressed[i].resize(compress_bound(compression, chunk.size()));
+            compressed[i].resize(compress(compression, level, chunk.data(), chunk.size(), compressed[i].data()));
+        });
+        for (size_t i = 0; i < end - begin; ++i) {
+            CompressedChunk &entry = directory[begin + i];
+            entry.offset = w.offset;
+            entry.size = compressed[i].size();
+            entry.checksum = checksum(compressed[i].data(), compressed[i].size());
+            w.write(compressed[i].data(), compressed[i].size());
+        }
+    }
+
+    static const char zeros[alignof(CompressedChunk)] = {};
+    w.write(zeros, (alignof(CompressedChunk) - w.offset % alignof(CompressedChunk)) % alignof(CompressedChunk));
+    header.directory_offset = w.offset;
+    header.num_chunks = directory.size();
+    w.write(directory.data(), directory.size() * sizeof(CompressedChunk));
+
+    if (std::fflush(f.get()) != 0 || std::fseek(f.get(), 0, SEEK_SET) != 0)
+        throw std::system_error(errno, std::system_category(), filename);
+    w.write(&header, sizeof(header));
+    if (std::fclose(f.release()) != 0)
+        throw std::system_error(errno, std::system_category(), filename);
+}
+
+// A chunk to decompress, and where to decompress it.
+struct DecompressionTask {
+    const CompressedChunk *chunk;
+    char *destination;
+};
+
+// Check that a column of the file matches the type it's read as, and that
+// the chunks of its array'th array cover exactly size bytes. Called before
+// the array is allocated, so a corrupt file can't cause a huge allocation.
+template <typename T>
+void check_array(const MappedFile &file, const CompressedHeader &header, const CompressedColumnHeader &column,
+                 BinaryColumnKind kind, size_t array, size_t size) {
+    if (column.kind != kind)
+        throw std::runtime_error("read_compressed: the file stores a different kind of column");
+    if (column.type_hash != binary_type_hash<T>() ||
+        (kind == BinaryColumnKind::Fixed && column.element_size != sizeof(T)))
+        throw std::runtime_error("read_compressed: the file stores a column of a different type");
+
+    const CompressedArray &a = column.arrays[array];
+    if (a.size != size)
+        throw std::runtime_error("read_compressed: column size doesn't match the number of rows");
+    if (a.first_chunk > header.num_chunks || a.num_chunks > header.num_chunks - a.first_chunk)
+        throw std::runtime_error("read_compressed: corrupt directory");
+
+    auto directory = reinterpret_cast<const CompressedChunk *>(file.data + header.directory_offset);
+    size_t covered = 0;
+    for (size_t i = a.first_chunk; i < a.first_chunk + a.num_chunks; ++i) {
+        const CompressedChunk &chunk = directory[i];
+        if (chunk.array_offset != covered || chunk.array_size > size - covered ||
+            chunk.offset > header.directory_offset || chunk.size > header.directory_offset - chunk.offset)
+            throw std::runtime_error("read_compressed: corrupt directory");
+        covered += chunk.array_size;
+    }
+    if (covered != size)
+        throw std::runtime_error("read_compressed: corrupt directory");
+}
+
+// The number of bytes of n entries of size element_size.
+inline size_t array_bytes(uint64_t n, size_t element_size) {
+    if (n > SIZE_MAX / element_size)
+        throw std::runtime_error("read_compressed: corrupt number of rows");
+    return n * element_size;
+}
+
+inline void add_decompression_tasks(const MappedFile &file, const CompressedHeader &header, const CompressedArray &a,
+                                    char *destination, std::vector<DecompressionTask> &tasks) {
+    auto directory = reinterpret_cast<const CompressedChunk *>(file.data + header.directory_offset);
+    for (size_t i = a.first_chunk; i < a.first_chunk + a.num_chunks; ++i)
+        tasks.push_back({&directory[i], destination + directory[i].array_offset});
+}
+
+// Allocate the arrays of a column, and list the chunks to decompress into
+// them.
+inline void plan_decompression(const MappedFile &, const CompressedHeader &header,
+                               const CompressedColumnHeader &column, std::vector<RangeTag> &v,
+                               std::vector<DecompressionTask> &) {
+    if (column.kind != BinaryColumnKind::Range)
+        throw std::runtime_error("read_compressed: the file stores a different kind of column");
+    v.sz = header.num_rows;
+}
+
+template <typename T>
+void plan_decompression(const MappedFile &file, const CompressedHeader &header,
+                        const CompressedColumnHeader &column, std::vector<T> &v,
+                        std::vector<DecompressionTask> &tasks) {
+    check_array<T>(file, header, column, BinaryColumnKind::Fixed, 0, array_bytes(header.num_rows, sizeof(T)));
+    v.resize(header.num_rows);
+    add_decompression_tasks(file, header, column.arrays[0], reinterpret_cast<char *>(v.data()), tasks);
+}
+
+inline void plan_decompression(const MappedFile &file, const CompressedHeader &header,
+                               const CompressedColumnHeader &column, std::vector<StringArena> &v,
+                               std::vector<DecompressionTask> &tasks) {
+    check_array<std::string>(file, header, column, BinaryColumnKind::Strings, 0,
+                             array_bytes(header.num_rows + 1, sizeof(size_t)));
+    check_array<std::string>(file, header, column, BinaryColumnKind::Strings, 1, column.arrays[1].size);
+    v.offsets.resize(header.num_rows + 1);
+    v.bytes.resize(column.arrays[1].size);
+    add_decompression_tasks(file, header, column.arrays[0], reinterpret_cast<char *>(v.offsets.data()), tasks);
+    add_decompression_tasks(file, header, column.arrays[1], v.bytes.data(), tasks);
+}
+
+// Strings are only safe to use once their offsets are known to be in bounds.
+template <typename T>
+void check_decompressed(const std::vector<T> &) {}
+
+inline void check_decompressed(const std::vector<StringArena> &v) {
+    if (v.offsets[0] != 0 || v.offsets.back() != v.bytes.size() ||
+        !std::is_sorted(v.offsets.begin(), v.offsets.end()))
+        throw std::runtime_error("read_compressed: corrupt string offsets");
+}
+
+// Load a dataframe written by write_compressed. Tag and Value are the
+// storage types the dataframe was written with. Its chunks are verified and
+// decompressed on num_threads threads. Trivially copyable tags and values are
+// loaded into std::vectors, and strings into StringArenas.
+template <typename Tag, typename Value>
+auto read_compressed(const std::string &filename, size_t num_threads = default_executor().concurrency()) {
+    MappedFile file(filename);
+    file.prefetch();
+    if (file.size < sizeof(CompressedHeader))
+        throw std::runtime_error("read_compressed: " + filename + " is too short to be a compressed dataframe");
+
+    CompressedHeader header;
+    std::memcpy(&header, file.data, sizeof(header));
+    if (std::memcmp(header.magic, compressed_magic, sizeof(compressed_magic)) != 0)
+        throw std::runtime_error("read_compressed: " + filename + " is not a compressed dataframe");
+    if (header.version != compressed_version || header.byte_order != binary_byte_order)
+        throw std::runtime_error("read_compressed: " + filename + " has an unsupported version or byte order");
+    if (header.directory_offset > file.size ||
+        header.num_chunks > (file.size - header.directory_offset) / sizeof(CompressedChunk) ||
+        header.directory_offset % alignof(CompressedChunk))
+        throw std::runtime_error("read_compressed: " + filename + " is truncated");
+
+    DataFrame<typename CompressedStorage<Tag>::type, typename CompressedStorage<Value>::type> df;
+    std::vector<DecompressionTask> tasks;
+    plan_decompression(file, header, header.tags, *df.tags, tasks);
+    plan_decompression(file, header, header.values, *df.values, tasks);
+
+    parallel_for_each_index(tasks.size(), num_threads, [&](size_t i) {
+        const CompressedChunk &chunk = *tasks[i].chunk;
+        if (checksum(file.data + chunk.offset, chunk.size) != chunk.checksum)
+            throw std::runtime_error("read_compressed: checksum mismatch");
+        decompress(header.compression, file.data + chunk.offset, chunk.size, tasks[i].destination, chunk.array_size);
+    });
+
+    check_decompressed(*df.tags);
+    check_decompressed(*df.values);
+    return df;
+}
@@ -1,8 +1,11 @@
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <functional>
+#include <map>
 #include <memory>
 #include <numeric>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -10,6 +13,16 @@ struct RangeTag {};
 
 struct NoTag {};
 
+template <typename _T>
+struct RunLengthTag {};
+
+template <typename _T>
+struct Categorical {};
+
+struct StringArena {};
+
+struct MemoryUsage;
+
 template <typename _T>
 struct ConstantValue {};
 
@@ -39,6 +52,11 @@ struct DataFrame : Operations<DataFrame<_Tag, _Value>> {
     using Tag = std::vector<_Tag>::value_type;
     using Value = std::vector<_Value>::value_type;
 
+    // The types returned by indexing the tags and values arrays. These are
+    // const references, except for arrays that compute their entries on the fly.
+    using TagRef = decltype(std::declval<const std::vector<_Tag> &>()[0]);
+    using ValueRef = decltype(std::declval<const std::vector<_Value> &>()[0]);
+
     std::shared_ptr<std::vector<_Tag>> tags;
     std::shared_ptr<std::vector<_Value>> values;
 
@@ -48,6 +66,9 @@ struct DataFrame : Operations<DataFrame<_Tag, _Value>> {
 
     size_t size() const { return tags->size(); }
 
+    // Bytes held by the tags and values, and how many dataframes share them.
+    MemoryUsage memory_usage() const;
+
     template <typename ValueOther>
     auto operator[](const DataFrame<Tag, ValueOther> &index) {
         return Operations<DataFrame<_Tag, _Value>>::collate(
@@ -57,14 +78,14 @@ struct DataFrame : Operations<DataFrame<_Tag, _Value>> {
     auto operator[](size_t i) {
         struct TagValue {
             Tag t;
-            Value &v;
+            decltype(std::declval<std::vector<_Value> &>()[i]) v;
         };
         return TagValue{(*tags)[i], (*values)[i]};
     }
     auto operator[](size_t i) const {
         struct TagValueConst {
             Tag t;
-            const Value &v;
+            ValueRef v;
         };
         return TagValueConst{(*tags)[i], (*values)[i]};
     }
@@ -96,10 +117,167 @@ struct std::vector<ConstantValue<T>> {
     const T &operator[](size_t i) const { return v; }
 };
 
+// A std::vector for tags that come in long runs of the same value, as they do
+// after retagging onto a low-cardinality key. Each run is stored once as a
+// (tag, run_end) pair, where run_end is one past the index of the run's last
+// entry.
+template <typename T>
+struct std::vector<RunLengthTag<T>> {
+    using value_type = T;
+
+    std::vector<std::pair<T, size_t>> runs;
+
+    vector() {}
+    vector(std::initializer_list<T> tags) {
+        for (const T &t : tags)
+            push_back(t);
+    }
+    vector(const std::vector<T> &tags) {
+        for (const T &t : tags)
+            push_back(t);
+    }
+
+    size_t size() const { return runs.empty() ? 0 : runs.back().second; }
+
+    // The index of the run that contains entry i.
+    size_t run_of(size_t i) const {
+        return std::upper_bound(runs.begin(), runs.end(), i, [](size_t i, const auto &run) { return i < run.second; }) -
+               runs.begin();
+    }
+
+    const T &operator[](size_t i) const { return runs[run_of(i)].first; }
+
+    void push_back(const T &t) {
+        if (!runs.empty() && runs.back().first == t)
+            runs.back().second++;
+        else
+            runs.emplace_back(t, size() + 1);
+    }
+};
+
+// The distinct values of a dictionary-encoded column, each identified by a
+// code. Columns that hold a reference to the same Dictionary agree on their
+// codes, so a Dictionary can be shared by many dataframes.
+template <typename T>
+struct Dictionary {
+    std::vector<T> values;
+    std::map<T, uint32_t> codes;
+
+    // The code for v. Adds v to the dictionary if it's not there yet.
+    uint32_t code(const T &v) {
+        auto [it, inserted] = codes.try_emplace(v, values.size());
+        if (inserted)
+            values.push_back(v);
+        return it->second;
+    }
+};
+
+// A std::vector for dictionary-encoded values. Each entry is stored as a code
+// into a Dictionary. Values are decoded only when they're indexed.
+template <typename T>
+struct std::vector<Categorical<T>> {
+    using value_type = T;
+
+    std::shared_ptr<Dictionary<T>> dictionary;
+    std::vector<uint32_t> codes;
+
+    vector() : dictionary(new Dictionary<T>) {}
+    vector(std::shared_ptr<Dictionary<T>> _dictionary) : dictionary(_dictionary) {}
+    vector(std::initializer_list<T> values) : dictionary(new Dictionary<T>) {
+        for (const T &v : values)
+            push_back(v);
+    }
+
+    size_t size() const { return codes.size(); }
+
+    const T &operator[](size_t i) const { return dictionary->values[codes[i]]; }
+
+    void push_back(const T &v) { codes.push_back(dictionary->code(v)); }
+};
+
+// A std::vector for strings that keeps the bytes of all its strings in one
+// contiguous buffer. Entry i occupies bytes[offsets[i]:offsets[i + 1]]. Entries
+// are exposed as std::string_views into the buffer, so they remain valid only
+// until the next push_back.
+template <>
+struct std::vector<StringArena> {
+    using value_type = std::string_view;
+
+    std::string bytes;
+    std::vector<size_t> offsets;
+
+    vector() : offsets{0} {}
+    vector(std::initializer_list<std::string_view> strings) : offsets{0} {
+        for (std::string_view s : strings)
+            push_back(s);
+    }
+
+    size_t size() const { return offsets.size() - 1; }
+
+    std::string_view operator[](size_t i) const {
+        return std::string_view(bytes.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    void push_back(std::string_view s) {
+        bytes.append(s);
+        offsets.push_back(bytes.size());
+    }
+
+    void reserve(size_t num_strings, size_t num_bytes) {
+        offsets.reserve(num_strings + 1);
+        bytes.reserve(num_bytes);
+    }
+
+    struct const_iterator {
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+
+        const vector *strings;
+        size_t i;
+
+        std::string_view operator*() const { return (*strings)[i]; }
+        const_iterator &operator++() {
+            ++i;
+            return *this;
+        }
+        const_iterator operator++(int) { return const_iterator{strings, i++}; }
+        bool operator==(const const_iterator &other) const { return i == other.i; }
+    };
+
+    const_iterator begin() const { return const_iterator{this, 0}; }
+    const_iterator end() const { return const_iterator{this, size()}; }
+};
+
+// The storage a materialized expression uses for its tags and values. Strings
+// that are only viewed, like the entries of a StringArena, are copied into a
+// new StringArena so they outlive the expression that produced them.
+template <typename T>
+struct Storage {
+    using type = T;
+};
+
+template <>
+struct Storage<std::string_view> {
+    using type = StringArena;
+};
+
 // Ask clang-format to not sort the order of these. Their order is important
 // because some of these depend on each other.
 // clang-format off
 #include "timer.h"
+#include "memory.h"
+#include "executor.h"
 #include "expressions.h"
+#include "prefetch.h"
 #include "formatting.h"
+#include "binary.h"
+#include "arrow.h"
+#include "compressed.h"
+#include "appendable.h"
+#include "partitioned.h"
+#include "ingest.h"
+#include "pipeline.h"
+#include "generator.h"
+#include "shared_memory.h"
+#include "shuffle.h"
 // clang-format on
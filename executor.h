@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef DATAFRAME_WITH_EXECUTION_POLICIES
+#include <execution>
+#endif
+
+// Runs tasks. The library's parallel operations run on an executor rather
+// than starting their own threads, so several of them running at once share
+// the same threads instead of oversubscribing the machine.
+struct Executor {
+    virtual ~Executor() = default;
+
+    // The number of tasks the executor runs at once.
+    virtual size_t concurrency() const = 0;
+
+    // Run task eventually. Tasks must not throw.
+    virtual void submit(std::function<void()> task) = 0;
+};
+
+// Runs each task on the calling thread as soon as it's submitted.
+struct SerialExecutor : Executor {
+    size_t concurrency() const override { return 1; }
+
+    void submit(std::function<void()> task) override { task(); }
+};
+
+/* A pool of worker threads that balance their load by stealing work.
+
+Each worker has its own deque of tasks. Tasks submitted from a worker go to
+the back of its own deque, and tasks submitted from other threads are dealt
+round-robin to the workers. A worker runs the task at the back of its own
+deque, which is the one most likely to still be in its cache. When its deque
+is empty, it steals the task at the front of another worker's deque, which is
+the oldest, and so usually the one that would take longest to get to.
+
+Worker i is pinned to the CPU cpus[i % cpus.size()], unless cpus is empty.
+*/
+struct ThreadPool : Executor {
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // Workers sleep on cv when there are no tasks. pending counts the tasks
+    // that are queued. It can go briefly negative when a worker takes a task
+    // before its submitter has counted it.
+    std::mutex mutex;
+    std::condition_variable cv;
+    long pending = 0;
+    bool stopping = false;
+
+    std::atomic<size_t> next_worker = 0;
+
+    // The pool and index of the worker running on this thread, if any.
+    static inline thread_local ThreadPool *current_pool = nullptr;
+    static inline thread_local size_t current_worker = 0;
+
+    ThreadPool(size_t num_threads = std::thread::hardware_concurrency(), const std::vector<int> &cpus = {}) {
+        num_threads = std::max<size_t>(num_threads, 1);
+        for (size_t i = 0; i < num_threads; ++i)
+            workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < num_threads; ++i)
+            workers[i]->thread = std::thread([this, i] { work(i); });
+
+        if (!cpus.empty()) {
+            for (size_t i = 0; i < num_threads; ++i) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                int cpu = cpus[i % cpus.size()];
+                if (cpu >= 0 && cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &set);
+                if (int error = pthread_setaffinity_np(workers[i]->thread.native_handle(), sizeof(set), &set)) {
+                    stop();
+                    throw std::system_error(error, std::generic_category(),
+                                            "Couldn't pin a worker to CPU " + std::to_string(cpu));
+                }
+            }
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Runs the tasks that are still queued before returning.
+    ~ThreadPool() override { stop(); }
+
+    size_t concurrency() const override { return workers.size(); }
+
+    void submit(std::function<void()> task) override {
+        size_t w = current_pool == this ? current_worker : next_worker++ % workers.size();
+        {
+            std::lock_guard lock(workers[w]->mutex);
+            workers[w]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard lock(mutex);
+            pending++;
+        }
+        cv.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+            if (worker->thread.joinable())
+                worker->thread.join();
+    }
+
+    // Take a task from the back of worker w's deque, or else from the front
+    // of another's.
+    std::function<void()> take_task(size_t w) {
+        std::function<void()> task;
+        for (size_t k = 0; k < workers.size() && !task; ++k) {
+            auto &worker = *workers[(w + k) % workers.size()];
+            std::lock_guard lock(worker.mutex);
+            if (worker.tasks.empty())
+                continue;
+            if (k == 0) {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            } else {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+        }
+        return task;
+    }
+
+    void work(size_t w) {
+        current_pool = this;
+        current_worker = w;
+        while (true) {
+            if (auto task = take_task(w)) {
+                {
+                    std::lock_guard lock(mutex);
+                    pending--;
+                }
+                task();
+                continue;
+            }
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping && pending <= 0)
+                return;
+        }
+    }
+};
+
+// The executor that parallel operations use unless they're given one. It's
+// a ThreadPool with a worker per hardware thread until set_default_executor
+// replaces it.
+inline std::atomic<Executor *> &default_executor_override() {
+    static std::atomic<Executor *> executor = nullptr;
+    return executor;
+}
+
+inline Executor &default_executor() {
+    if (auto executor = default_executor_override().load())
+        return *executor;
+    static ThreadPool pool;
+    return pool;
+}
+
+// Run parallel operations on executor, which must outlive them. nullptr
+// restores the library's own pool.
+inline void set_default_executor(Executor *executor) { default_executor_override() = executor; }
+
+// Call f(i) for each i in [0, n) on at most max_threads of executor's
+// threads. The calling thread takes part, and each thread takes the next
+// index when it's done with its previous one, so threads stay busy even when
+// some indices take longer than others. Since the caller doesn't wait on
+// queued tasks, calling this from inside f doesn't deadlock. Rethrows the
+// first exception that f throws, after which the remaining indices are
+// skipped.
+template <typename F>
+void parallel_for_each_index(Executor &executor, size_t n, size_t max_threads, F f) {
+    size_t num_threads = std::min({n, max_threads, executor.concurrency()});
+    if (num_threads <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+
+    // Helpers that start after the last index is done find no indices to
+    // claim, so they only touch the loop's shared state, never f.
+    struct Loop {
+        std::atomic<size_t> next = 0;
+        std::atomic<bool> failed = false;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t done = 0;
+        std::exception_ptr error;
+    };
+    auto loop = std::make_shared<Loop>();
+    auto run = [loop, n, &f] {
+        size_t completed = 0;
+        for (size_t i; (i = loop->next++) < n; ++completed) {
+            if (loop->failed)
+                continue;
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard lock(loop->mutex);
+                if (!loop->error)
+                    loop->error = std::current_exception();
+                loop->failed = true;
+            }
+        }
+        if (completed) {
+            std::lock_guard lock(loop->mutex);
+            loop->done += completed;
+            if (loop->done == n)
+                loop->cv.notify_all();
+        }
+    };
+
+    for (size_t t = 1; t < num_threads; ++t)
+        executor.submit(run);
+    run();
+
+    std::unique_lock lock(loop->mutex);
+    loop->cv.wait(lock, [&] { return loop->done == n; });
+    if (loop->error)
+        std::rethrow_exception(loop->error);
+}
+
+template <typename F>
+void parallel_for_each_index(size_t n, size_t max_threads, F f) {
+    parallel_for_each_index(default_executor(), n, max_threads, f);
+}
+
+// The executor that carries out a standard execution policy: sequenced
+// policies run on the calling thread and parallel ones on the default
+// executor. Only available when DATAFRAME_WITH_EXECUTION_POLICIES is defined
+// before including dataframe.h, because libstdc++'s <execution> requires
+// linking with -ltbb when TBB is installed.
+#ifdef DATAFRAME_WITH_EXECUTION_POLICIES
+template <typename Policy>
+    requires std::is_execution_policy_v<std::remove_cvref_t<Policy>>
+Executor &executor_for(Policy &&) {
+    if constexpr (std::is_same_v<std::remove_cvref_t<Policy>, std::execution::sequenced_policy> ||
+                  std::is_same_v<std::remove_cvref_t<Policy>, std::execution::unsequenced_policy>) {
+        static SerialExecutor serial;
+        return serial;
+    } else
+        return default_executor();
+}
+
+template <typename Policy, typename F>
+    requires std::is_execution_policy_v<std::remove_cvref_t<Policy>>
+void parallel_for_each_index(Policy &&policy, size_t n, F f) {
+    Executor &executor = executor_for(policy);
+    parallel_for_each_index(executor, n, executor.concurrency(), f);
+}
+#endif
@@ -1,10 +1,18 @@
 #include <concepts>
 #include <map>
+#include <ranges>
 #include <type_traits>
+#include <unordered_map>
 
 template <typename Derived>
 struct Expr_Operations;
 
+template <typename Expr>
+struct Expr_Pipelined;
+
+template <typename Df>
+auto to_branch(Df df, size_t batch_size, size_t queue_depth);
+
 // A wrapper for a materialized dataframe.
 template <typename _Tag, typename _Value>
 struct Expr_DataFrame : Expr_Operations<Expr_DataFrame<_Tag, _Value>> {
@@ -16,18 +24,28 @@ struct Expr_DataFrame : Expr_Operations<Expr_DataFrame<_Tag, _Value>> {
 
     Expr_DataFrame(DataFrame<_Tag, _Value> _df) : df(_df), i(0) {}
 
-    const Tag &tag() const { return (*df.tags)[i]; }
+    DataFrame<_Tag, _Value>::TagRef tag() const { return (*df.tags)[i]; }
 
-    const Value &value() const { return (*df.values)[i]; }
+    DataFrame<_Tag, _Value>::ValueRef value() const { return (*df.values)[i]; }
+
+    // The dictionary code of the current value, when the values are dictionary
+    // encoded.
+    uint32_t code() const
+        requires requires { df.values->codes; }
+    {
+        return df.values->codes[i];
+    }
 
     void next() { i++; }
 
     bool end() const { return i >= df.size(); }
 
     void advance_to_tag(Tag t) {
-        auto l = std::lower_bound(df.tags->begin(), df.tags->end(), t);
-        if (*l == t)
-            i = l - df.tags->begin();
+        // Binary search by index, since not every tags array has random access iterators.
+        auto l = std::ranges::partition_point(std::views::iota(size_t(0), df.size()),
+                                              [this, &t](size_t j) { return (*df.tags)[j] < t; });
+        if (*l < df.size() && (*df.tags)[*l] == t)
+            i = *l;
         else
             i = df.size();  // Didn't find the tag. It's the end of this expression.
     }
@@ -39,14 +57,20 @@ struct Expr_DataFrame<RangeTag, _Value> : Expr_Operations<Expr_DataFrame<RangeTa
     using Tag = size_t;
     using Value = DataFrame<RangeTag, _Value>::Value;
 
-    DataFrame<RangeTag, Value> df;
+    DataFrame<RangeTag, _Value> df;
     size_t i;
 
     Expr_DataFrame(DataFrame<RangeTag, _Value> _df) : df(_df), i(0) {}
 
     const size_t &tag() const { return i; }
 
-    const Value &value() const { return (*df.values)[i]; }
+    DataFrame<RangeTag, _Value>::ValueRef value() const { return (*df.values)[i]; }
+
+    uint32_t code() const
+        requires requires { df.values->codes; }
+    {
+        return df.values->codes[i];
+    }
 
     void next() { i++; }
 
@@ -55,6 +79,53 @@ struct Expr_DataFrame<RangeTag, _Value> : Expr_Operations<Expr_DataFrame<RangeTa
     void advance_to_tag(Tag t) { i = t; }
 };
 
+// A wrapper for a materialized dataframe with run-length encoded tags. Walks
+// the runs alongside the entries, so neither tag() nor next() search the runs.
+template <typename T, typename _Value>
+struct Expr_DataFrame<RunLengthTag<T>, _Value> : Expr_Operations<Expr_DataFrame<RunLengthTag<T>, _Value>> {
+    using Tag = T;
+    using Value = DataFrame<RunLengthTag<T>, _Value>::Value;
+
+    DataFrame<RunLengthTag<T>, _Value> df;
+    size_t i;
+    size_t run;
+
+    Expr_DataFrame(DataFrame<RunLengthTag<T>, _Value> _df) : df(_df), i(0), run(0) {}
+
+    const Tag &tag() const { return df.tags->runs[run].first; }
+
+    DataFrame<RunLengthTag<T>, _Value>::ValueRef value() const { return (*df.values)[i]; }
+
+    uint32_t code() const
+        requires requires { df.values->codes; }
+    {
+        return df.values->codes[i];
+    }
+
+    void next() {
+        if (++i == df.tags->runs[run].second)
+            run++;
+    }
+
+    bool end() const { return i >= df.size(); }
+
+    // The number of entries left in the current run, including the current
+    // entry. Expr_Reduction uses this to reduce a whole run without comparing
+    // tags.
+    size_t run_remaining() const { return df.tags->runs[run].second - i; }
+
+    void advance_to_tag(Tag t) {
+        const auto &runs = df.tags->runs;
+        auto l =
+            std::lower_bound(runs.begin(), runs.end(), t, [](const auto &run, const Tag &t) { return run.first < t; });
+        if (l != runs.end() && l->first == t) {
+            run = l - runs.begin();
+            i = run == 0 ? 0 : runs[run - 1].second;
+        } else
+            i = df.size();  // Didn't find the tag. It's the end of this expression.
+    }
+};
+
 template <typename Expr, typename Tag>
 void advance_to_tag_by_linear_search(Expr &df, Tag t) {
     while (!df.end() && (df.tag() != t))
@@ -65,7 +136,7 @@ void advance_to_tag_by_linear_search(Expr &df, Tag t) {
 // sorted.
 template <typename T>
 void argsort(const std::vector<T> &array, std::vector<size_t> &indices) {
-    std::map<T, std::vector<size_t>> indices_map;
+    std::map<typename std::vector<T>::value_type, std::vector<size_t>> indices_map;
 
     for (size_t i = 0; i < array.size(); ++i)
         indices_map[array[i]].push_back(i);
@@ -76,6 +147,28 @@ void argsort(const std::vector<T> &array, std::vector<size_t> &indices) {
             indices.push_back(i);
 }
 
+// Dictionary-encoded values are sorted without comparing them: the entries are
+// bucketed by code, and the buckets are visited in the order of the
+// dictionary's values. Like the above, entries with equal values keep their
+// order.
+template <typename T>
+void argsort(const std::vector<Categorical<T>> &array, std::vector<size_t> &indices) {
+    std::vector<size_t> offsets(array.dictionary->values.size(), 0);
+    for (uint32_t code : array.codes)
+        offsets[code]++;
+
+    size_t offset = indices.size();
+    for (const auto &[value, code] : array.dictionary->codes) {
+        size_t count = offsets[code];
+        offsets[code] = offset;
+        offset += count;
+    }
+
+    indices.resize(offset);
+    for (size_t i = 0; i < array.size(); ++i)
+        indices[offsets[array.codes[i]]++] = i;
+}
+
 // Replace the tags of a materialized dataframe with the values of another
 // materialized dataframe.
 template <typename TagT, typename ValueT, typename TagV, typename ValueV>
@@ -93,12 +186,14 @@ struct Expr_Retag : Expr_Operations<Expr_Retag<TagT, ValueT, TagV, ValueV>> {
         : df_tags(_df_tags), df_values(_df_values), i(0), traversal_order(new std::vector<size_t>) {
         if (df_tags.size() != df_values.size())
             throw std::invalid_argument("df_tags and df_values must have the same length");
+        AllocationScope scope("Expr_Retag");
+        ProfileZone zone("Expr_Retag");
         argsort(*df_tags.values, *traversal_order);
     }
 
-    const Tag &tag() const { return (*df_tags.values)[(*traversal_order)[i]]; }
+    DataFrame<TagT, ValueT>::ValueRef tag() const { return (*df_tags.values)[(*traversal_order)[i]]; }
 
-    const Value &value() const { return (*df_values.values)[(*traversal_order)[i]]; }
+    DataFrame<TagV, ValueV>::ValueRef value() const { return (*df_values.values)[(*traversal_order)[i]]; }
 
     void next() { i++; }
 
@@ -123,30 +218,53 @@ struct Expr_Apply : Expr_Operations<Expr_Apply<Expr, ApplyOp>> {
     using Tag = typename Expr::Tag;
     using Value = std::invoke_result_t<ApplyOp, typename Expr::Tag, typename Expr::Value>;
 
-    const Tag *_tag;
+    // Points to df's current tag, or holds a copy of it when df computes its
+    // tags on the fly (like the string_views of a StringArena).
+    static constexpr bool tag_is_reference = std::is_reference_v<decltype(std::declval<Expr &>().tag())>;
+    std::conditional_t<tag_is_reference, const Tag *, Tag> _tag;
     Value _value;
 
-    Expr_Apply(Expr _df, ApplyOp _apply_op) : df(_df), apply_op(_apply_op) { update_tagvalue(); }
+    Expr_Apply(Expr _df, ApplyOp _apply_op) : df(_df), apply_op(_apply_op) {
+        if (!df.end())
+            update_tagvalue();
+    }
 
     void update_tagvalue() {
-        _tag = &df.tag();
+        if constexpr (tag_is_reference)
+            _tag = &df.tag();
+        else
+            _tag = df.tag();
         _value = apply_op(df.tag(), df.value());
     }
 
-    const Tag &tag() const { return *_tag; }
+    const Tag &tag() const {
+        if constexpr (tag_is_reference)
+            return *_tag;
+        else
+            return _tag;
+    }
 
     const Value &value() const { return _value; }
 
     void next() {
         df.next();
-        update_tagvalue();
+        if (!df.end())
+            update_tagvalue();
     }
 
     bool end() const { return df.end(); }
 
+    // Expr_Apply stays in sync with df, so df's runs of tags are its runs too.
+    size_t run_remaining() const
+        requires requires(const Expr &e) { e.run_remaining(); }
+    {
+        return df.run_remaining();
+    }
+
     void advance_to_tag(const Tag &t) {
         df.advance_to_tag(t);
-        update_tagvalue();
+        if (!df.end())
+            update_tagvalue();
     }
 };
 
@@ -181,12 +299,20 @@ struct Expr_Reduction : Expr_Operations<Expr_Reduction<Expr, ReduceOp>> {
         _tag = df.tag();
         _value = reduce_op(df.tag(), df.value());
 
+        // The number of entries of df known to share this tag without comparing
+        // tags. Expressions over run-length encoded tags report their whole run.
+        size_t run_remaining = 1;
+        if constexpr (requires { df.run_remaining(); })
+            run_remaining = df.run_remaining();
+
         df.next();
 
         // Reduce all tags that coincide if a reduction operation is supplied. If ReduceOp
         // is not a reduction, this expression amounts to a slightly slower version of
         // Expr_Apply.
         if constexpr (std::is_invocable_v<ReduceOp, Tag, typename Expr::Value, Value>) {
+            for (; --run_remaining > 0; df.next())
+                _value = reduce_op(df.tag(), df.value(), _value);
             for (; !df.end() && (df.tag() == _tag); df.next())
                 _value = reduce_op(df.tag(), df.value(), _value);
         }
@@ -220,13 +346,16 @@ struct Expr_Intersection : Expr_Operations<Expr_Intersection<Expr1, Expr2, Merge
             if (df1.end())
                 continue;  // df1 has no matching tag. Move to the next tag in df2.
 
-            _value = merge_op(df1.tag(), df1.value(), df2.value());
+            if constexpr (requires { merge_op.on_codes(df1.code(), df2.code()); })
+                _value = merge_op.on_codes(df1.code(), df2.code());
+            else
+                _value = merge_op(df1.tag(), df1.value(), df2.value());
 
             break;
         }
     }
 
-    const Tag &tag() { return df2.tag(); }
+    decltype(auto) tag() { return df2.tag(); }
 
     const Value &value() { return _value; }
 
@@ -253,9 +382,9 @@ struct Expr_Union : Expr_Operations<Expr_Union<Expr1, Expr2>> {
 
     bool pick_from_df1() { return !df1.end() && (df2.end() || (df1.tag() < df2.tag())); }
 
-    const Tag &tag() { return pick_from_df1() ? df1.tag() : df2.tag(); }
+    decltype(auto) tag() { return pick_from_df1() ? df1.tag() : df2.tag(); }
 
-    const Value &value() { return pick_from_df1() ? df1.value() : df2.value(); }
+    decltype(auto) value() { return pick_from_df1() ? df1.value() : df2.value(); }
 
     void next() {
         if (pick_from_df1())
@@ -304,6 +433,38 @@ struct Moments {
     }
 };
 
+// A collate operation on two dictionary-encoded dataframes. Expr_Intersection
+// calls on_codes() with the codes of the two values, and the operation is only
+// evaluated once per distinct pair of codes.
+template <typename CollateOp, typename T1, typename T2>
+struct CollateOnCodes {
+    using Value = std::invoke_result_t<CollateOp, const T1 &, const T2 &>;
+
+    CollateOp op;
+    std::shared_ptr<Dictionary<T1>> dictionary1;
+    std::shared_ptr<Dictionary<T2>> dictionary2;
+    std::shared_ptr<std::unordered_map<uint64_t, Value>> memo;
+
+    CollateOnCodes(CollateOp _op, std::shared_ptr<Dictionary<T1>> _dictionary1,
+                   std::shared_ptr<Dictionary<T2>> _dictionary2)
+        : op(_op),
+          dictionary1(_dictionary1),
+          dictionary2(_dictionary2),
+          memo(new std::unordered_map<uint64_t, Value>) {}
+
+    template <typename Tag>
+    Value operator()(const Tag &, const T1 &v1, const T2 &v2) {
+        return op(v1, v2);
+    }
+
+    const Value &on_codes(uint32_t code1, uint32_t code2) {
+        auto [it, inserted] = memo->try_emplace((uint64_t(code1) << 32) | code2);
+        if (inserted)
+            it->second = op(dictionary1->values[code1], dictionary2->values[code2]);
+        return it->second;
+    }
+};
+
 // Convert a dataframe to a Expr_DataFrame. If the argument is already a
 // Expr_DataFrame, just return it as is.
 template <typename Tag, typename Value>
@@ -327,6 +488,51 @@ auto to_dataframe(Expr df) {
     return df.materialize();
 }
 
+// Apply a function of the value alone to every entry of a dataframe.
+template <typename Derived, typename ApplyOp>
+auto apply_to_values(Derived &df, ApplyOp op) {
+    return df.apply([op](typename Derived::Tag, const typename Derived::Value &v) { return op(v); });
+}
+
+// Applying a function of the value alone to a dictionary-encoded dataframe
+// evaluates the function once per distinct value rather than once per entry.
+// The result shares its tags with df and is dictionary-encoded too.
+template <typename Tag, typename T, typename ApplyOp>
+    requires std::totally_ordered<std::decay_t<std::invoke_result_t<ApplyOp, const T &>>>
+auto apply_to_values(DataFrame<Tag, Categorical<T>> &df, ApplyOp op) {
+    DataFrame<Tag, Categorical<std::decay_t<std::invoke_result_t<ApplyOp, const T &>>>> result;
+    result.tags = df.tags;
+
+    std::vector<uint32_t> recode;
+    for (const T &v : df.values->dictionary->values)
+        recode.push_back(result.values->dictionary->code(op(v)));
+
+    result.values->codes.reserve(df.size());
+    for (uint32_t code : df.values->codes)
+        result.values->codes.push_back(recode[code]);
+    return to_expr(result);
+}
+
+// Join two dataframes on their tags and combine their values with `op`.
+template <typename Derived, typename Expr, typename CollateOp>
+auto collate_values(Derived &df, Expr &df_other, CollateOp op) {
+    return Expr_Intersection(
+        df.to_expr(),
+        df_other.to_expr(),
+        [op](const typename Expr::Tag &, const typename Derived::Value &v1, const typename Expr::Value &v2) {
+            return op(v1, v2);
+        });
+}
+
+// Collating two dictionary-encoded dataframes evaluates `op` once per distinct
+// pair of values.
+template <typename Tag1, typename T1, typename Tag2, typename T2, typename CollateOp>
+auto collate_values(DataFrame<Tag1, Categorical<T1>> &df, DataFrame<Tag2, Categorical<T2>> &df_other, CollateOp op) {
+    return Expr_Intersection(to_expr(df),
+                             to_expr(df_other),
+                             CollateOnCodes<CollateOp, T1, T2>(op, df.values->dictionary, df_other.values->dictionary));
+}
+
 // The base class for Expr_*'s and materialized dataframes. These operations can
 // be applied to both.
 template <typename Derived>
@@ -370,7 +576,7 @@ struct Operations {
     // operation is supplied, and init() only takes the value, and not the tag.
     template <std::invocable<typename Derived::Value> ApplyOp>
     auto apply(ApplyOp op) {
-        return apply([&op](typename Derived::Tag, const typename Derived::Value &v) { return op(v); });
+        return ::apply_to_values(static_cast<Derived &>(*this), op);
     }
 
     template <typename ReduceOp>
@@ -424,27 +630,55 @@ struct Operations {
 
     template <typename Expr, std::invocable<typename Derived::Value, typename Expr::Value> CollateOp>
     auto collate(Expr df_other, CollateOp op) {
-        return Expr_Intersection(
-            to_expr(),
-            df_other.to_expr(),
-            [&op](const typename Expr::Tag &, const typename Derived::Value &v1, const typename Expr::Value &v2) {
-                return op(v1, v2);
-            });
+        return ::collate_values(static_cast<Derived &>(*this), df_other, op);
     }
 
     template <typename Expr>
     auto concatenate(Expr df_other) {
         return Expr_Union(to_expr(), df_other.to_expr());
     }
+
+    // Evaluate this expression on its own thread, in batches of batch_size
+    // entries, ahead of the expression that consumes it.
+    auto pipeline(size_t batch_size = 1024, size_t queue_depth = 8) {
+        return Expr_Pipelined<decltype(to_expr())>(to_expr(), batch_size, queue_depth);
+    }
+
+    // Like collate and concatenate, but evaluate this dataframe and df_other
+    // on two threads of their own when they're expressions, so expensive
+    // branches of a join or merge run in parallel. Each branch hands its
+    // entries to the join through a queue of up to queue_depth batches of
+    // batch_size entries.
+    template <typename Expr, std::invocable<typename Derived::Value, typename Expr::Value> CollateOp>
+    auto collate_parallel(Expr df_other, CollateOp op, size_t batch_size = 1024, size_t queue_depth = 8) {
+        return to_branch(static_cast<Derived &>(*this), batch_size, queue_depth)
+            .collate(to_branch(df_other, batch_size, queue_depth), op);
+    }
+
+    template <typename Expr>
+    auto concatenate_parallel(Expr df_other, size_t batch_size = 1024, size_t queue_depth = 8) {
+        return Expr_Union(to_branch(static_cast<Derived &>(*this), batch_size, queue_depth),
+                          to_branch(df_other, batch_size, queue_depth));
+    }
 };
 
 // Operations that only work on Expr_*'s and not on materialized DataFrames.
 template <typename Derived>
 struct Expr_Operations : Operations<Derived> {
     auto materialize() {
+        return materialize_as<typename Storage<typename Derived::Tag>::type,
+                              typename Storage<typename Derived::Value>::type>();
+    }
+
+    // Evaluate the expression into a new dataframe whose tags are stored as
+    // TagStorage (for example, RunLengthTag<Tag>) and values as ValueStorage.
+    template <typename TagStorage, typename ValueStorage>
+    auto materialize_as() {
+        AllocationScope scope("materialize");
+        ProfileZone zone("materialize");
         auto expr = static_cast<Derived &>(*this);
 
-        DataFrame<typename Derived::Tag, typename Derived::Value> mdf;
+        DataFrame<TagStorage, ValueStorage> mdf;
         for (; !expr.end(); expr.next()) {
             mdf.tags->push_back(expr.tag());
             mdf.values->push_back(expr.value());
@@ -453,4 +687,13 @@ struct Expr_Operations : Operations<Derived> {
     }
 
     auto operator*() { return materialize(); }
+
+    // Materialize into a dataframe whose tags are run-length encoded. This is
+    // worthwhile when tags come in long runs, as they do after a retag onto a
+    // low-cardinality key.
+    auto materialize_run_length() {
+        using Tag = typename Derived::Tag;
+        using RunTag = std::conditional_t<std::is_same_v<Tag, std::string_view>, std::string, Tag>;
+        return materialize_as<RunLengthTag<RunTag>, typename Storage<typename Derived::Value>::type>();
+    }
 };
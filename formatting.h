@@ -1,12 +1,33 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cerrno>
+#include <charconv>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <ranges>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 // Forward declaration of a materialized dataframe.
 template <typename Tag, typename Value>
@@ -14,54 +35,104 @@ struct DataFrame;
 
 template <typename Tag, typename Value>
 std::ostream& operator<<(std::ostream& s, const DataFrame<Tag, Value>& df) {
-    for (size_t i = 0; i < df.size(); ++i)
-        s << df[i].t << '\t' << df[i].v << std::endl;
+    for (size_t i = 0; i < df.size(); ++i) {
+        auto [t, v] = df[i];
+        s << t << '\t' << v << '\n';
+    }
     return s;
 }
 
-void from_string(int& v, const std::string_view& s) { v = std::atoi(s.begin()); }
-void from_string(float& v, const std::string_view& s) { v = std::atof(s.begin()); }
+// Parses numbers with std::from_chars, which reads straight from the buffer
+// without needing a terminating NUL and ignores the locale. Fields that aren't
+// numbers parse as 0.
+template <typename T>
+    requires std::is_arithmetic_v<T>
+void from_string(T& v, const std::string_view& s) {
+    if (std::from_chars(s.data(), s.data() + s.size(), v).ec != std::errc())
+        v = 0;
+}
 void from_string(std::string& v, const std::string_view& s) { v = s; }
+void from_string(std::string_view& v, const std::string_view& s) { v = s; }
+
+// Store the offsets of the first max_delimiters tabs and newlines of s in
+// delimiters, and return how many were found. Compares 16 bytes at a time when
+// SSE2 is available.
+size_t find_delimiters(const std::string_view& s, size_t* delimiters, size_t max_delimiters) {
+    size_t n = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= s.size(); i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s.data() + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, tab), _mm_cmpeq_epi8(bytes, newline)));
+        for (; mask; mask &= mask - 1) {
+            if (n == max_delimiters)
+                return n;
+            delimiters[n++] = i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < s.size() && n < max_delimiters; ++i)
+        if (s[i] == '\t' || s[i] == '\n')
+            delimiters[n++] = i;
+    return n;
+}
 
 void parse_tab_separated_string(const std::string_view& s) { std::cout << "Extra stuff left: '" << s << "\'\n"; }
 
+// Parse the tab-separated fields of a line into values. Finds all the
+// delimiters the values need in one pass before parsing any of them. The line
+// ends at its first newline. Values for which the line has no field are left
+// untouched.
 template <typename T, typename... Types>
 void parse_tab_separated_string(const std::string_view& s, T& v, Types&... others) {
-    auto i_end = s.find_first_of('\t');
-    from_string(v, s.substr(0, i_end));
-
-    if (i_end != std::string_view::npos)
-        parse_tab_separated_string(s.substr(i_end + 1), others...);
-}
-
-std::string_view get_line(char* line, int max_line_length, FILE* f) {
-    char* r = std::fgets(line, max_line_length, f);
-    if (r) {
-        // confirm the last character is a newline. otherwise the buffer was too
-        // short to hold a line.
-        std::string_view sv(line);
-        if (sv.back() != '\n')
-            throw std::runtime_error("Line exceeds buffer. Consider increasing the buffer size.");
-        return sv;
-    } else {
-        return std::string_view("");
-    }
+    constexpr size_t num_values = 1 + sizeof...(Types);
+    size_t delimiters[num_values];
+    size_t num_delimiters = find_delimiters(s, delimiters, num_values);
+
+    size_t field = 0;
+    size_t field_begin = 0;
+    bool line_ended = false;
+    auto parse_field = [&](auto& value) {
+        if (line_ended)
+            return;
+        size_t field_end = field < num_delimiters ? delimiters[field] : s.size();
+        from_string(value, s.substr(field_begin, field_end - field_begin));
+        line_ended = field_end == s.size() || s[field_end] == '\n';
+        field_begin = field_end + 1;
+        field++;
+    };
+    parse_field(v);
+    (parse_field(others), ...);
+
+    if (!line_ended)
+        parse_tab_separated_string(s.substr(field_begin));
 }
 
-template <std::ranges::range Container>
-void read_tsv(Container& records, const std::string& tsv_filename, int header_lines = 1, int max_line_length = 5000) {
-    auto tsv = std::unique_ptr<FILE, decltype(&std::fclose)>(std::fopen(tsv_filename.c_str(), "r"), &std::fclose);
-    if (!tsv)
-        throw std::system_error(errno, std::system_category(), tsv_filename);
+// Reads the first field of a line. This lets read_tsv<StringArena> copy a column
+// of strings straight into the arena without constructing a std::string per
+// line.
+void from_tab_separated_string(std::string_view& v, const std::string_view& s) {
+    from_string(v, s.substr(0, s.find_first_of("\t\n")));
+}
 
-    char line[max_line_length];
+// Read the lines of a tsv file into records. The file is read ahead of the
+// parser by a PrefetchingReader, with queue_depth buffers of buffer_size bytes.
+template <std::ranges::range Container>
+void read_tsv(Container& records,
+              const std::string& tsv_filename,
+              int header_lines = 1,
+              size_t buffer_size = 1 << 20,
+              size_t queue_depth = 4) {
+    PrefetchingLineReader tsv(tsv_filename, buffer_size, queue_depth);
 
     // skip the header
     for (int i = 0; i < header_lines; ++i)
-        get_line(line, sizeof(line), tsv.get());
+        tsv.next_line();
 
     while (true) {
-        auto line_string_view = get_line(line, sizeof(line), tsv.get());
+        auto line_string_view = tsv.next_line();
         if (line_string_view.empty())
             break;
 
@@ -77,4 +148,395 @@ DataFrame<RangeTag, T> read_tsv(const std::string& tsv_filename, TSVArgs... args
     read_tsv(*df.values, tsv_filename, args...);
     df.tags->sz = df.values->size();
     return df;
-}
\ No newline at end of file
+}
+
+// An expression that streams the records of a tsv file without materializing
+// them. Like the DataFrame that read_tsv returns, each record is tagged with
+// its row number. The file is read ahead into queue_depth buffers of
+// buffer_size bytes while the records are parsed and evaluated, so memory use
+// is bounded by the buffers and the longest line.
+//
+// All copies of the expression share the file, so like any stream, it can
+// only be traversed once. Operations that materialize their inputs, like
+// retag, consume the stream.
+template <typename T>
+struct Expr_TsvSource : Expr_Operations<Expr_TsvSource<T>> {
+    using Tag = size_t;
+    using Value = T;
+
+    std::shared_ptr<PrefetchingLineReader> stream;
+    size_t row;
+    T record;
+    bool _end;
+
+    Expr_TsvSource(const std::string& tsv_filename,
+                   int header_lines = 1,
+                   size_t buffer_size = 1 << 20,
+                   size_t queue_depth = 4)
+        : stream(new PrefetchingLineReader(tsv_filename, buffer_size, queue_depth)), row(0), _end(false) {
+        for (int i = 0; i < header_lines; ++i)
+            stream->next_line();
+        parse_next_line();
+    }
+
+    void parse_next_line() {
+        auto line = stream->next_line();
+        _end = line.empty();
+        if (!_end)
+            from_tab_separated_string(record, line);
+    }
+
+    const Tag& tag() const { return row; }
+
+    const Value& value() const { return record; }
+
+    void next() {
+        row++;
+        parse_next_line();
+    }
+
+    bool end() const { return _end; }
+
+    // Skips the lines before row t without parsing them. Streams can't go
+    // back, so asking for an earlier row ends the expression.
+    void advance_to_tag(Tag t) {
+        if (t < row)
+            _end = true;
+        if (_end || t == row)
+            return;
+        for (; !_end && row + 1 < t; row++)
+            _end = stream->next_line().empty();
+        if (!_end) {
+            row++;
+            parse_next_line();
+        }
+    }
+};
+
+// A read-only memory mapping of a whole file.
+struct MappedFile {
+    int fd;
+    const char* data;
+    size_t size;
+
+    MappedFile(const std::string& filename) : MappedFile(::open(filename.c_str(), O_RDONLY), filename) {}
+
+    // Map the file that's open as _fd, which the MappedFile then owns. filename
+    // is for error messages.
+    MappedFile(int _fd, const std::string& filename) : fd(_fd), data(nullptr), size(0) {
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), filename);
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            throw std::system_error(errno, std::system_category(), filename);
+        }
+        size = st.st_size;
+
+        // mmap can't map an empty file.
+        if (size == 0)
+            return;
+
+        void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            throw std::system_error(errno, std::system_category(), filename);
+        }
+        data = static_cast<const char*>(p);
+        ::madvise(p, size, MADV_SEQUENTIAL);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data)
+            ::munmap(const_cast<char*>(data), size);
+        ::close(fd);
+    }
+
+    std::string_view view() const { return std::string_view(data, size); }
+
+    // Ask the kernel to read the whole file in the background, ahead of the
+    // page faults that would otherwise read it a little at a time.
+    void prefetch() const {
+        if (data)
+            ::madvise(const_cast<char*>(data), size, MADV_WILLNEED);
+    }
+};
+
+// Drop the first num_lines lines of text.
+std::string_view skip_lines(std::string_view text, int num_lines) {
+    for (int i = 0; i < num_lines && !text.empty(); ++i) {
+        auto eol = text.find('\n');
+        text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+    }
+    return text;
+}
+
+// Split text into at most num_chunks pieces of roughly equal size that each
+// end at the end of a line.
+std::vector<std::string_view> split_at_lines(std::string_view text, size_t num_chunks) {
+    std::vector<std::string_view> chunks;
+    size_t chunk_size = text.size() / std::max<size_t>(num_chunks, 1) + 1;
+    while (!text.empty()) {
+        auto eol = text.find('\n', std::min(chunk_size, text.size()) - 1);
+        size_t end = eol == std::string_view::npos ? text.size() : eol + 1;
+        chunks.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    return chunks;
+}
+
+// The number of lines in text, counting a last line that lacks a newline.
+size_t count_lines(std::string_view text) {
+    size_t n = std::count(text.begin(), text.end(), '\n');
+    return n + (!text.empty() && text.back() != '\n');
+}
+
+// Parse each line of text into consecutive entries of records. Like read_tsv,
+// hands from_tab_separated_string each line with its newline, except for a
+// last line that lacks one.
+template <typename T>
+void parse_tsv_lines(std::string_view text, T* records) {
+    while (!text.empty()) {
+        auto eol = text.find('\n');
+        size_t end = eol == std::string_view::npos ? text.size() : eol + 1;
+        from_tab_separated_string(*records++, text.substr(0, end));
+        text.remove_prefix(end);
+    }
+}
+
+// Like read_tsv, but maps the file into memory and parses it on several
+// threads. The file is split into one chunk per thread at line boundaries. The
+// threads first count the lines in their chunk, which determines where each
+// chunk's records go in the dataframe, then parse their chunk straight into
+// its slice of the dataframe.
+template <typename T>
+DataFrame<RangeTag, T> read_tsv_parallel(const std::string& tsv_filename,
+                                         int header_lines = 1,
+                                         size_t num_threads = default_executor().concurrency()) {
+    MappedFile file(tsv_filename);
+    auto chunks = split_at_lines(skip_lines(file.view(), header_lines), num_threads);
+
+    // Run f(c) for each chunk c on the default executor.
+    auto for_each_chunk = [&chunks, num_threads](auto f) { parallel_for_each_index(chunks.size(), num_threads, f); };
+
+    std::vector<size_t> offsets(chunks.size() + 1, 0);
+    for_each_chunk([&](size_t c) { offsets[c + 1] = count_lines(chunks[c]); });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    DataFrame<RangeTag, T> df;
+    df.values->resize(offsets.back());
+    for_each_chunk([&](size_t c) { parse_tsv_lines(chunks[c], df.values->data() + offsets[c]); });
+    df.tags->sz = df.values->size();
+    return df;
+}
+
+// Append a field of a delimiter-separated line to out. Numbers are formatted
+// with std::to_chars. Types without an overload are formatted with
+// operator<<. Overload format_field for record types to write them as several
+// fields.
+template <typename T>
+void format_field(std::string& out, const T& v, char) {
+    std::ostringstream s;
+    s << v;
+    out += s.str();
+}
+
+template <typename T>
+    requires std::is_arithmetic_v<T>
+void format_field(std::string& out, const T& v, char) {
+    if constexpr (std::is_same_v<T, bool>) {
+        out += v ? '1' : '0';
+    } else {
+        char buffer[64];
+        out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), v).ptr);
+    }
+}
+
+// Strings are written as is, except that CSV fields that contain a comma, a
+// quote or a newline are quoted.
+inline void format_field(std::string& out, std::string_view v, char delimiter) {
+    if (delimiter != ',' || v.find_first_of(",\"\n") == std::string_view::npos) {
+        out += v;
+        return;
+    }
+    out += '"';
+    for (char c : v) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+inline void format_field(std::string& out, const std::string& v, char delimiter) {
+    format_field(out, std::string_view(v), delimiter);
+}
+inline void format_field(std::string& out, const char* v, char delimiter) {
+    format_field(out, std::string_view(v), delimiter);
+}
+
+template <typename Tag, typename Value>
+void format_line(std::string& out, const Tag& t, const Value& v, char delimiter) {
+    format_field(out, t, delimiter);
+    out += delimiter;
+    format_field(out, v, delimiter);
+    out += '\n';
+}
+
+// Write the entries of a dataframe or an expression as delimiter-separated
+// lines of tag and value. Lines are formatted into a buffer that's written to
+// out whenever it holds buffer_size bytes. Expressions are written as they're
+// evaluated, without materializing them.
+template <typename Expr>
+void write_separated(
+    Expr df, std::ostream& out, const std::string& header, char delimiter, size_t buffer_size = 1 << 20) {
+    std::string buffer;
+    buffer.reserve(buffer_size + 4096);
+    if (!header.empty())
+        buffer += header + '\n';
+
+    for (auto expr = df.to_expr(); !expr.end(); expr.next()) {
+        format_line(buffer, expr.tag(), expr.value(), delimiter);
+        if (buffer.size() >= buffer_size) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    out.write(buffer.data(), buffer.size());
+}
+
+template <typename Expr>
+void write_tsv(Expr df, std::ostream& out, const std::string& header = "") {
+    write_separated(df, out, header, '\t');
+}
+
+template <typename Expr>
+void write_csv(Expr df, std::ostream& out, const std::string& header = "") {
+    write_separated(df, out, header, ',');
+}
+
+// Like write_tsv, but formats a materialized dataframe on several threads.
+// Each round, the threads format consecutive chunks of rows_per_chunk rows
+// into their own buffers, which are then written in order.
+template <typename Tag, typename Value>
+void write_tsv_parallel(const DataFrame<Tag, Value>& df,
+                        std::ostream& out,
+                        const std::string& header = "",
+                        size_t num_threads = default_executor().concurrency(),
+                        size_t rows_per_chunk = 1 << 16,
+                        char delimiter = '\t') {
+    num_threads = std::max<size_t>(num_threads, 1);
+    if (!header.empty())
+        out << header << '\n';
+
+    std::vector<std::string> buffers(num_threads);
+    for (size_t round_begin = 0; round_begin < df.size(); round_begin += num_threads * rows_per_chunk) {
+        parallel_for_each_index(num_threads, num_threads, [&](size_t c) {
+            size_t begin = std::min(df.size(), round_begin + c * rows_per_chunk);
+            size_t end = std::min(df.size(), begin + rows_per_chunk);
+            buffers[c].clear();
+            for (size_t i = begin; i < end; ++i) {
+                auto [t, v] = df[i];
+                format_line(buffers[c], t, v, delimiter);
+            }
+        });
+        for (auto& buffer : buffers)
+            out.write(buffer.data(), buffer.size());
+    }
+}
+
+// Append the entries of one array to another of the same storage.
+template <typename T>
+void append_storage(std::vector<T>& v, std::vector<T>&& other) {
+    if (v.empty())
+        v = std::move(other);
+    else
+        v.insert(v.end(), std::make_move_iterator(other.begin()), std::make_move_iterator(other.end()));
+}
+
+inline void append_storage(std::vector<StringArena>& v, std::vector<StringArena>&& other) {
+    size_t base = v.bytes.size();
+    v.bytes += other.bytes;
+    for (size_t i = 1; i < other.offsets.size(); ++i)
+        v.offsets.push_back(base + other.offsets[i]);
+}
+
+// Parse the given columns of each line of text, and append them to the
+// arrays in values. Only looks for the tabs that precede the last column it
+// needs, and doesn't parse the other fields. Columns missing from a line get
+// a default value. There must be at least one column.
+template <typename... Ts, typename... Storages>
+void parse_tsv_columns(std::string_view text,
+                       const std::array<size_t, sizeof...(Ts)>& columns,
+                       std::tuple<std::vector<Storages>...>& values) {
+    if (columns.empty())
+        throw std::invalid_argument("parse_tsv_columns: no columns to read");
+    size_t max_delimiters = *std::max_element(columns.begin(), columns.end()) + 1;
+    std::vector<size_t> delimiters(max_delimiters);
+
+    while (!text.empty()) {
+        size_t n = find_delimiters(text, delimiters.data(), max_delimiters);
+        size_t num_fields = n < max_delimiters ? n + 1 : max_delimiters;
+        size_t eol = std::string_view::npos;
+        for (size_t i = 0; i < n; ++i)
+            if (text[delimiters[i]] == '\n') {
+                num_fields = i + 1;
+                eol = delimiters[i];
+                break;
+            }
+        if (eol == std::string_view::npos && n == max_delimiters)
+            eol = text.find('\n', delimiters[n - 1]);
+
+        [&]<size_t... I>(std::index_sequence<I...>) {
+            [[maybe_unused]] auto parse_column = [&]<typename T>(T value, size_t field, auto& storage) {
+                if (field < num_fields) {
+                    size_t begin = field ? delimiters[field - 1] + 1 : 0;
+                    size_t end = field < n ? delimiters[field] : text.size();
+                    from_string(value, text.substr(begin, end - begin));
+                }
+                storage.push_back(value);
+            };
+            (parse_column(Ts{}, columns[I], std::get<I>(values)), ...);
+        }(std::index_sequence_for<Ts...>());
+
+        text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+    }
+}
+
+// Read some columns of a tsv file into one dataframe per column, without
+// parsing the other columns. columns are the indices of the columns to read,
+// and Ts are their types. Columns of strings can be read as std::string, or
+// as std::string_view to store them in a StringArena. The dataframes share
+// one RangeTag that numbers the rows. Like read_tsv_parallel, the file is
+// mapped into memory and parsed on several threads.
+//
+//   auto [ages, heights] = read_tsv_columns<int, float>("people.tsv", {1, 2});
+template <typename... Ts>
+auto read_tsv_columns(const std::string& tsv_filename,
+                      const std::array<size_t, sizeof...(Ts)>& columns,
+                      int header_lines = 1,
+                      size_t num_threads = default_executor().concurrency()) {
+    MappedFile file(tsv_filename);
+    auto chunks = split_at_lines(skip_lines(file.view(), header_lines), num_threads);
+
+    using Values = std::tuple<std::vector<typename Storage<Ts>::type>...>;
+    std::vector<Values> chunk_values(chunks.size());
+    parallel_for_each_index(chunks.size(), num_threads,
+                            [&](size_t c) { parse_tsv_columns<Ts...>(chunks[c], columns, chunk_values[c]); });
+
+    auto tags = std::make_shared<std::vector<RangeTag>>();
+    std::tuple<DataFrame<RangeTag, typename Storage<Ts>::type>...> dfs;
+    [&]<size_t... I>(std::index_sequence<I...>) {
+        [[maybe_unused]] auto gather_column = [&](auto& df, auto get) {
+            df.tags = tags;
+            for (Values& values : chunk_values)
+                append_storage(*df.values, std::move(get(values)));
+            tags->sz = df.values->size();
+        };
+        (gather_column(std::get<I>(dfs), [](Values& values) -> auto& { return std::get<I>(values); }), ...);
+    }(std::index_sequence_for<Ts...>());
+    return dfs;
+}
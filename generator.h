@@ -0,0 +1,199 @@
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+// A minimal coroutine generator. The coroutine yields values of type T with
+// co_yield, and its consumer pulls them one at a time with next(). The
+// generator keeps a pointer to the yielded object rather than a copy, so
+// yielding an lvalue doesn't copy it. A yielded temporary lives until the
+// coroutine resumes.
+template <typename T>
+struct Generator {
+    using value_type = T;
+
+    struct promise_type {
+        const T *current = nullptr;
+        std::exception_ptr error;
+
+        Generator get_return_object() { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+
+        std::suspend_always yield_value(const T &v) {
+            current = &v;
+            return {};
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Generator(std::coroutine_handle<promise_type> _handle) : handle(_handle) {}
+    Generator(Generator &&other) : handle(std::exchange(other.handle, {})) {}
+    Generator(const Generator &) = delete;
+    Generator &operator=(const Generator &) = delete;
+
+    ~Generator() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Run the coroutine to its next co_yield. Returns false when it has
+    // finished instead. Rethrows what the coroutine threw.
+    bool next() {
+        handle.resume();
+        if (handle.promise().error)
+            std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+        return !handle.done();
+    }
+
+    // The value of the last co_yield.
+    const T &value() const { return *handle.promise().current; }
+};
+
+/* An expression whose entries are yielded by a coroutine.
+
+make() returns a Generator of (tag, value) pairs, which it must yield in
+increasing order of tag. The coroutine can be a producer that reads messages
+or parses a custom file format, and it runs only when the expression needs
+its next entry. For example,
+
+    auto df = from_generator([]() -> Generator<std::pair<int, float>> {
+        for (int i = 0; i < 10; ++i)
+            co_yield {i, i * 0.5f};
+    });
+
+Like Expr_Pipelined, the coroutine starts when the entries are first needed.
+Copies made before then call make() to evaluate the entries independently,
+and copies made after share the same stream.
+*/
+template <typename F>
+struct Expr_Generator : Expr_Operations<Expr_Generator<F>> {
+    using Row = typename std::invoke_result_t<F &>::value_type;
+    using Tag = typename Row::first_type;
+    using Value = typename Row::second_type;
+
+    struct State {
+        std::invoke_result_t<F &> generator;
+        bool done;
+    };
+
+    mutable F make;
+    mutable std::shared_ptr<State> state;
+
+    Expr_Generator(F _make) : make(_make) {}
+
+    State &started() const {
+        if (!state) {
+            state.reset(new State{make(), false});
+            state->done = !state->generator.next();
+        }
+        return *state;
+    }
+
+    const Tag &tag() const { return started().generator.value().first; }
+
+    const Value &value() const { return started().generator.value().second; }
+
+    void next() {
+        auto &s = started();
+        s.done = !s.generator.next();
+    }
+
+    bool end() const { return started().done; }
+
+    void advance_to_tag(Tag t) { advance_to_tag_by_linear_search(*this, t); }
+};
+
+template <typename F>
+auto from_generator(F make) {
+    return Expr_Generator<F>(make);
+}
+
+/* A coroutine that consumes the entries of a dataframe. The coroutine awaits
+each entry with co_await next_row, which gives the tag and value by reference,
+or nullopt after the last entry. feed() drives it. For example,
+
+    Sink<int, float> total(float &sum) {
+        while (auto row = co_await next_row)
+            sum += row->second;
+    }
+
+    feed(df, total(sum));
+
+The sink can stop early by returning, in which case feed() stops evaluating
+the dataframe.
+*/
+struct NextRow {};
+inline constexpr NextRow next_row;
+
+template <typename Tag, typename Value>
+struct Sink {
+    using Row = std::pair<const Tag &, const Value &>;
+
+    struct promise_type {
+        std::optional<Row> current;
+        std::exception_ptr error;
+
+        Sink get_return_object() { return Sink(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+
+        auto await_transform(NextRow) {
+            struct Awaiter {
+                promise_type *promise;
+                bool await_ready() { return false; }
+                void await_suspend(std::coroutine_handle<>) {}
+                std::optional<Row> await_resume() { return promise->current; }
+            };
+            return Awaiter{this};
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Sink(std::coroutine_handle<promise_type> _handle) : handle(_handle) {}
+    Sink(Sink &&other) : handle(std::exchange(other.handle, {})) {}
+    Sink(const Sink &) = delete;
+    Sink &operator=(const Sink &) = delete;
+
+    ~Sink() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Hand row to the sink and run it until it awaits the next one. Returns
+    // false once the sink has finished. Rethrows what the sink threw.
+    bool resume(std::optional<Row> row) {
+        auto &current = handle.promise().current;
+        current.reset();
+        if (row)
+            current.emplace(*row);
+        handle.resume();
+        if (handle.promise().error)
+            std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+        return !handle.done();
+    }
+};
+
+// Pass the entries of df to sink, in order, then tell it there are no more.
+template <typename Df, typename Tag, typename Value>
+void feed(Df df, Sink<Tag, Value> sink) {
+    auto expr = ::to_expr(df);
+    // Run the sink up to its first co_await.
+    if (!sink.resume(std::nullopt))
+        return;
+    for (; !expr.end(); expr.next()) {
+        const Tag &t = expr.tag();
+        const Value &v = expr.value();
+        if (!sink.resume(typename Sink<Tag, Value>::Row(t, v)))
+            return;
+    }
+    sink.resume(std::nullopt);
+}
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <queue>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Collects rows that several threads produce into one dataframe.
+
+Each producing thread appends through its own Writer, which fills a private
+chunk of rows without any synchronization. A full chunk is published by
+pushing it onto a lock-free list of chunks with a single compare-and-swap, so
+producers never wait on each other.
+
+When Tag is RangeTag, writers append values, and finish() concatenates the
+chunks in the order they were published into a DataFrame<RangeTag, Value>.
+Otherwise writers append tagged rows, and finish() sorts each chunk and then
+merges them in parallel into a dataframe sorted by tag.
+
+finish() must be called after every writer has been destroyed or flushed.
+*/
+template <typename Tag, typename Value>
+struct ConcurrentBuilder {
+    static constexpr bool range_tags = std::is_same_v<Tag, RangeTag>;
+    using Row = std::conditional_t<range_tags, Value, std::pair<Tag, Value>>;
+
+    struct Chunk {
+        std::vector<Row> rows;
+        Chunk *next = nullptr;
+    };
+
+    // The published chunks, newest first.
+    std::atomic<Chunk *> published = nullptr;
+    size_t chunk_size;
+
+    ConcurrentBuilder(size_t _chunk_size = 1 << 14) : chunk_size(std::max<size_t>(_chunk_size, 1)) {}
+
+    ConcurrentBuilder(const ConcurrentBuilder &) = delete;
+    ConcurrentBuilder &operator=(const ConcurrentBuilder &) = delete;
+
+    ~ConcurrentBuilder() {
+        for (auto chunk : take_chunks())
+            delete chunk;
+    }
+
+    void publish(Chunk *chunk) {
+        chunk->next = published.load(std::memory_order_relaxed);
+        while (!published.compare_exchange_weak(chunk->next, chunk, std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+        }
+    }
+
+    // Remove the published chunks, oldest first.
+    std::vector<Chunk *> take_chunks() {
+        std::vector<Chunk *> chunks;
+        for (Chunk *c = published.exchange(nullptr, std::memory_order_acquire); c; c = c->next)
+            chunks.push_back(c);
+        std::reverse(chunks.begin(), chunks.end());
+        return chunks;
+    }
+
+    // Appends rows on behalf of one thread. Publishes its last chunk when
+    // it's destroyed.
+    struct Writer {
+        ConcurrentBuilder *builder;
+        std::unique_ptr<Chunk> chunk;
+
+        Writer(ConcurrentBuilder &_builder) : builder(&_builder) {}
+        Writer(Writer &&) = default;
+        ~Writer() { flush(); }
+
+        void push_back(const Value &v)
+            requires range_tags
+        {
+            emplace(v);
+        }
+
+        void push_back(const Tag &t, const Value &v)
+            requires(!range_tags)
+        {
+            emplace(t, v);
+        }
+
+        template <typename... Args>
+        void emplace(Args &&...args) {
+            if (!chunk) {
+                chunk.reset(new Chunk);
+                chunk->rows.reserve(builder->chunk_size);
+            }
+            chunk->rows.emplace_back(std::forward<Args>(args)...);
+            if (chunk->rows.size() == builder->chunk_size)
+                flush();
+        }
+
+        // Publish the rows appended so far.
+        void flush() {
+            if (chunk && !chunk->rows.empty())
+                builder->publish(chunk.release());
+        }
+    };
+
+    Writer writer() { return Writer(*this); }
+
+    // Move the published rows into a dataframe, and start over with an empty
+    // builder.
+    auto finish(size_t num_threads = default_executor().concurrency()) {
+        std::vector<std::unique_ptr<Chunk>> chunks;
+        for (auto chunk : take_chunks())
+            chunks.emplace_back(chunk);
+
+        std::vector<size_t> offsets = {0};
+        for (auto &chunk : chunks)
+            offsets.push_back(offsets.back() + chunk->rows.size());
+
+        if constexpr (range_tags) {
+            DataFrame<RangeTag, Value> df;
+            df.values->resize(offsets.back());
+            parallel_for_each_index(chunks.size(), num_threads, [&](size_t c) {
+                std::move(chunks[c]->rows.begin(), chunks[c]->rows.end(), df.values->begin() + offsets[c]);
+            });
+            df.tags->sz = offsets.back();
+            return df;
+        } else {
+            auto by_tag = [](const Row &a, const Row &b) { return a.first < b.first; };
+            parallel_for_each_index(chunks.size(), num_threads, [&](size_t c) {
+                std::stable_sort(chunks[c]->rows.begin(), chunks[c]->rows.end(), by_tag);
+            });
+
+            // Split the range of tags at splitters sampled from the chunks, so
+            // that each part of the output can be merged independently.
+            size_t num_parts = std::max<size_t>(4 * num_threads, 1);
+            std::vector<Tag> samples;
+            for (auto &chunk : chunks)
+                for (size_t k = 1; k < num_parts; ++k)
+                    samples.push_back(chunk->rows[chunk->rows.size() * k / num_parts].first);
+            std::sort(samples.begin(), samples.end());
+            std::vector<Tag> splitters;
+            for (size_t k = 1; k < num_parts && !samples.empty(); ++k)
+                splitters.push_back(samples[samples.size() * k / num_parts]);
+            splitters.erase(std::unique(splitters.begin(), splitters.end()), splitters.end());
+            num_parts = splitters.size() + 1;
+
+            // bounds[p][c] is where part p begins in chunk c.
+            std::vector<std::vector<size_t>> bounds(num_parts + 1, std::vector<size_t>(chunks.size()));
+            for (size_t c = 0; c < chunks.size(); ++c) {
+                auto &rows = chunks[c]->rows;
+                for (size_t p = 1; p < num_parts; ++p)
+                    bounds[p][c] = std::lower_bound(rows.begin(), rows.end(), splitters[p - 1],
+                                                    [](const Row &r, const Tag &t) { return r.first < t; }) -
+                                   rows.begin();
+                bounds[num_parts][c] = rows.size();
+            }
+            std::vector<size_t> part_offsets = {0};
+            for (size_t p = 0; p < num_parts; ++p) {
+                size_t n = 0;
+                for (size_t c = 0; c < chunks.size(); ++c)
+                    n += bounds[p + 1][c] - bounds[p][c];
+                part_offsets.push_back(part_offsets.back() + n);
+            }
+
+            DataFrame<Tag, Value> df;
+            df.tags->resize(offsets.back());
+            df.values->resize(offsets.back());
+            parallel_for_each_index(num_parts, num_threads, [&](size_t p) {
+                // Merge the chunks' slices of this part. Ties go to the
+                // earlier chunk.
+                using Head = std::pair<size_t, size_t>;  // (chunk, row)
+                auto later = [&](const Head &a, const Head &b) {
+                    const Tag &ta = chunks[a.first]->rows[a.second].first;
+                    const Tag &tb = chunks[b.first]->rows[b.second].first;
+                    return tb < ta || (!(ta < tb) && a.first > b.first);
+                };
+                std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+                for (size_t c = 0; c < chunks.size(); ++c)
+                    if (bounds[p][c] < bounds[p + 1][c])
+                        heads.push({c, bounds[p][c]});
+                for (size_t i = part_offsets[p]; !heads.empty(); ++i) {
+                    auto [c, r] = heads.top();
+                    heads.pop();
+                    (*df.tags)[i] = std::move(chunks[c]->rows[r].first);
+                    (*df.values)[i] = std::move(chunks[c]->rows[r].second);
+                    if (r + 1 < bounds[p + 1][c])
+                        heads.push({c, r + 1});
+                }
+            });
+            return df;
+        }
+    }
+};
@@ -0,0 +1,159 @@
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "allocation_counter.h"
+
+// Forward declaration of a materialized dataframe.
+template <typename Tag, typename Value>
+struct DataFrame;
+
+// Bytes of heap memory owned by an object, beyond sizeof(object). Overload
+// this for value types that own heap memory so memory_usage() can count it.
+template <typename T>
+size_t heap_bytes(const T &) {
+    return 0;
+}
+
+inline size_t heap_bytes(const std::string &s) {
+    // Short strings live inside the string object itself.
+    bool is_short = s.data() >= reinterpret_cast<const char *>(&s) && s.data() < reinterpret_cast<const char *>(&s + 1);
+    return is_short ? 0 : s.capacity() + 1;
+}
+
+// Bytes of memory held by a tags or values array, including its heap memory.
+template <typename T>
+size_t storage_bytes(const std::vector<T> &v) {
+    size_t bytes = sizeof(v) + v.capacity() * sizeof(T);
+    if constexpr (!std::is_trivially_copyable_v<T>)
+        for (const T &x : v)
+            bytes += heap_bytes(x);
+    return bytes;
+}
+
+inline size_t storage_bytes(const std::vector<RangeTag> &v) { return sizeof(v); }
+
+template <typename T>
+size_t storage_bytes(const std::vector<ConstantValue<T>> &v) {
+    return sizeof(v) + heap_bytes(v.v);
+}
+
+template <typename T>
+size_t storage_bytes(const std::vector<RunLengthTag<T>> &v) {
+    size_t bytes = sizeof(v) + v.runs.capacity() * sizeof(v.runs[0]);
+    for (const auto &run : v.runs)
+        bytes += heap_bytes(run.first);
+    return bytes;
+}
+
+// Includes the dictionary, even though it may be shared with other dataframes.
+template <typename T>
+size_t storage_bytes(const std::vector<Categorical<T>> &v) {
+    // Each entry of the dictionary's std::map is a tree node with three
+    // pointers and a color besides the entry itself.
+    constexpr size_t map_node_bytes = sizeof(typename std::map<T, uint32_t>::value_type) + 4 * sizeof(void *);
+    return sizeof(v) + v.codes.capacity() * sizeof(uint32_t) + storage_bytes(v.dictionary->values) +
+           v.dictionary->codes.size() * map_node_bytes;
+}
+
+inline size_t storage_bytes(const std::vector<StringArena> &v) {
+    return sizeof(v) + v.bytes.capacity() + v.offsets.capacity() * sizeof(size_t);
+}
+
+// The memory held by a dataframe, and the number of dataframes and
+// expressions that share each of its arrays.
+struct MemoryUsage {
+    size_t tag_bytes;
+    size_t value_bytes;
+    long tag_share_count;
+    long value_share_count;
+
+    size_t bytes() const { return tag_bytes + value_bytes; }
+};
+
+template <typename _Tag, typename _Value>
+MemoryUsage DataFrame<_Tag, _Value>::memory_usage() const {
+    return MemoryUsage{
+        .tag_bytes = storage_bytes(*tags),
+        .value_bytes = storage_bytes(*values),
+        .tag_share_count = tags.use_count(),
+        .value_share_count = values.use_count(),
+    };
+}
+
+// Attributes heap allocations to the operations that make them. Tracking is
+// off by default. When it's on, every AllocationScope adds the bytes and
+// number of allocations made while it was alive to the totals for its label.
+// Scopes nest, and a nested scope's label is prefixed with the labels of the
+// scopes that enclose it, like "pipeline/materialize".
+//
+// Allocations are only counted if operator new calls count_allocation(). To
+// get such an operator new, compile memory_tracking.cpp into the program.
+struct AllocationTracker {
+    struct Stats {
+        size_t bytes = 0;
+        size_t allocations = 0;
+        size_t calls = 0;
+    };
+
+    std::atomic<bool> enabled{false};
+    std::mutex mutex;
+    std::map<std::string, Stats> stats;
+
+    static AllocationTracker &global() {
+        static AllocationTracker tracker;
+        return tracker;
+    }
+
+    void enable() { enabled = true; }
+    void disable() { enabled = false; }
+
+    void reset() {
+        std::lock_guard lock(mutex);
+        stats.clear();
+    }
+
+    std::map<std::string, Stats> snapshot() {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
+
+    void record(const std::string &label, size_t bytes, size_t allocations) {
+        std::lock_guard lock(mutex);
+        auto &s = stats[label];
+        s.bytes += bytes;
+        s.allocations += allocations;
+        s.calls++;
+    }
+};
+
+// The label of the innermost AllocationScope on this thread.
+inline thread_local std::string thread_allocation_label;
+
+struct AllocationScope {
+    bool active;
+    std::string parent_label;
+    size_t bytes_at_start;
+    size_t allocations_at_start;
+
+    AllocationScope(const char *label) : active(AllocationTracker::global().enabled.load(std::memory_order_relaxed)) {
+        if (!active)
+            return;
+        parent_label = thread_allocation_label;
+        thread_allocation_label = parent_label.empty() ? label : parent_label + '/' + label;
+        bytes_at_start = thread_allocated_bytes;
+        allocations_at_start = thread_allocation_count;
+    }
+
+    AllocationScope(const AllocationScope &) = delete;
+
+    ~AllocationScope() {
+        if (!active)
+            return;
+        size_t bytes = thread_allocated_bytes - bytes_at_start;
+        size_t allocations = thread_allocation_count - allocations_at_start;
+        AllocationTracker::global().record(thread_allocation_label, bytes, allocations);
+        thread_allocation_label = parent_label;
+    }
+};
@@ -0,0 +1,65 @@
+/*
+Replaces the global operator new and operator delete with versions that count
+each allocation for AllocationTracker. Compile this file into programs that
+want AllocationScopes to report allocations, for example
+
+   clang++ -Wall -std=c++2b test_memory_tracking.cpp memory_tracking.cpp -lgtest_main -lgtest
+
+Every form of new and delete is replaced, so all of them go through malloc()
+and free() and are counted.
+*/
+
+#include <cstdlib>
+#include <new>
+
+#include "allocation_counter.h"
+
+namespace {
+
+void *allocate(size_t bytes) {
+    count_allocation(bytes);
+    return std::malloc(bytes ? bytes : 1);
+}
+
+void *allocate(size_t bytes, std::align_val_t alignment) {
+    count_allocation(bytes);
+    // aligned_alloc() needs the size to be a multiple of the alignment.
+    size_t a = static_cast<size_t>(alignment);
+    size_t rounded = (bytes + a - 1) / a * a;
+    return std::aligned_alloc(a, rounded ? rounded : a);
+}
+
+template <typename... Alignment>
+void *allocate_or_throw(size_t bytes, Alignment... alignment) {
+    if (void *p = allocate(bytes, alignment...))
+        return p;
+    throw std::bad_alloc();
+}
+
+}  // namespace
+
+void *operator new(size_t bytes) { return allocate_or_throw(bytes); }
+void *operator new[](size_t bytes) { return allocate_or_throw(bytes); }
+void *operator new(size_t bytes, const std::nothrow_t &) noexcept { return allocate(bytes); }
+void *operator new[](size_t bytes, const std::nothrow_t &) noexcept { return allocate(bytes); }
+void *operator new(size_t bytes, std::align_val_t alignment) { return allocate_or_throw(bytes, alignment); }
+void *operator new[](size_t bytes, std::align_val_t alignment) { return allocate_or_throw(bytes, alignment); }
+void *operator new(size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocate(bytes, alignment);
+}
+void *operator new[](size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocate(bytes, alignment);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Streams the entries of the partitions of a PartitionedDataFrame one
+// partition after the other. Since the partitions hold increasing ranges of
+// tags, that's tag order. advance_to_tag() only searches the partition whose
+// range can hold the tag.
+template <typename _Tag, typename _Value>
+struct Expr_Partitions : Expr_Operations<Expr_Partitions<_Tag, _Value>> {
+    using Tag = Expr_DataFrame<_Tag, _Value>::Tag;
+    using Value = Expr_DataFrame<_Tag, _Value>::Value;
+
+    // None of the partitions are empty.
+    std::vector<Expr_DataFrame<_Tag, _Value>> partitions;
+
+    // The current partition, or partitions.size() at the end.
+    size_t p;
+
+    Expr_Partitions(const std::vector<DataFrame<_Tag, _Value>> &dfs) : p(0) {
+        for (const auto &df : dfs)
+            partitions.emplace_back(df);
+    }
+
+    decltype(auto) tag() const { return partitions[p].tag(); }
+
+    decltype(auto) value() const { return partitions[p].value(); }
+
+    void next() {
+        partitions[p].next();
+        if (partitions[p].end())
+            p++;
+    }
+
+    bool end() const { return p == partitions.size(); }
+
+    void advance_to_tag(Tag t) {
+        // The first partition whose last tag is at least t.
+        p = *std::ranges::partition_point(std::views::iota(size_t(0), partitions.size()), [&](size_t q) {
+            const auto &df = partitions[q].df;
+            return (*df.tags)[df.size() - 1] < t;
+        });
+        if (end())
+            return;
+        partitions[p].advance_to_tag(t);
+        if (partitions[p].end())
+            p = partitions.size();  // Didn't find the tag. It's the end of this expression.
+    }
+};
+
+template <typename _Tag, typename _Value>
+struct PartitionedDataFrame;
+
+// Copy the rows [bounds[p], bounds[p+1]) of df into partition p of a
+// PartitionedDataFrame.
+template <typename Tag, typename Value>
+auto slice_partitions(const DataFrame<Tag, Value> &df, const std::vector<size_t> &bounds) {
+    using TagStorage = typename Storage<typename DataFrame<Tag, Value>::Tag>::type;
+    using ValueStorage = typename Storage<typename DataFrame<Tag, Value>::Value>::type;
+    std::vector<DataFrame<TagStorage, ValueStorage>> result(bounds.size() - 1);
+    for (size_t p = 0; p + 1 < bounds.size(); ++p) {
+        result[p].tags->reserve(bounds[p + 1] - bounds[p]);
+        result[p].values->reserve(bounds[p + 1] - bounds[p]);
+        for (size_t i = bounds[p]; i < bounds[p + 1]; ++i) {
+            auto [t, v] = df[i];
+            result[p].tags->push_back(t);
+            result[p].values->push_back(v);
+        }
+    }
+    return PartitionedDataFrame<TagStorage, ValueStorage>(result);
+}
+
+template <typename Df>
+constexpr bool is_partitioned = false;
+
+template <typename Tag, typename Value>
+constexpr bool is_partitioned<PartitionedDataFrame<Tag, Value>> = true;
+
+// Streams a PartitionedDataFrame through its to_expr(), and leaves any other
+// dataframe or expression as it is.
+template <typename Df>
+auto unpartitioned(Df df) {
+    if constexpr (is_partitioned<Df>)
+        return df.to_expr();
+    else
+        return df;
+}
+
+/* A dataframe split into materialized partitions, each holding a range of
+tags. The ranges are disjoint and increasing, so the entries of all the
+partitions, one partition after the other, are in tag order.
+
+It supports the operations of a DataFrame. Applies, reductions, collations
+and indexing run on each partition independently and in parallel on the
+default executor, and their results are partitioned the same way. Operations
+that move entries between partitions, like retag and concatenate, go through
+to_expr(), which streams the partitions in order. Looking up a tag only
+searches the partition whose range holds it.
+*/
+template <typename _Tag, typename _Value>
+struct PartitionedDataFrame {
+    using Tag = DataFrame<_Tag, _Value>::Tag;
+    using Value = DataFrame<_Tag, _Value>::Value;
+
+    // None of the partitions are empty.
+    std::vector<DataFrame<_Tag, _Value>> partitions;
+
+    PartitionedDataFrame() = default;
+
+    // Drops empty partitions. Throws if the partitions aren't sorted, or their
+    // tag ranges overlap.
+    PartitionedDataFrame(const std::vector<DataFrame<_Tag, _Value>> &dfs) {
+        for (const auto &df : dfs) {
+            if (df.size() == 0)
+                continue;
+            if (!partitions.empty() && !(last_tag(partitions.size() - 1) < (*df.tags)[0]))
+                throw std::runtime_error("Partitions must hold disjoint, increasing ranges of tags");
+            partitions.push_back(df);
+            for (size_t i = 1; i < df.size(); ++i)
+                if ((*df.tags)[i] < (*df.tags)[i - 1])
+                    throw std::runtime_error("Partitions must be sorted by tag");
+        }
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (const auto &df : partitions)
+            n += df.size();
+        return n;
+    }
+
+    size_t num_partitions() const { return partitions.size(); }
+
+    Tag first_tag(size_t p) const { return (*partitions[p].tags)[0]; }
+
+    Tag last_tag(size_t p) const { return (*partitions[p].tags)[partitions[p].size() - 1]; }
+
+    // The partition whose range of tags can hold t, or num_partitions() if
+    // there's none.
+    size_t partition_of(const Tag &t) const {
+        size_t p = *std::ranges::partition_point(std::views::iota(size_t(0), partitions.size()),
+                                                 [&](size_t q) { return last_tag(q) < t; });
+        return p < partitions.size() && !(t < first_tag(p)) ? p : partitions.size();
+    }
+
+    // The value of the first entry tagged t.
+    std::optional<Value> find(const Tag &t) const {
+        size_t p = partition_of(t);
+        if (p == partitions.size())
+            return std::nullopt;
+        auto e = ::to_expr(partitions[p]);
+        e.advance_to_tag(t);
+        if (e.end())
+            return std::nullopt;
+        return Value(e.value());
+    }
+
+    // Split the rows of df at the first tags of this dataframe's partitions,
+    // so that the result is partitioned like this one.
+    template <typename Df>
+    auto split_like(Df df) const {
+        auto m = ::to_dataframe(df);
+        std::vector<size_t> bounds = {0};
+        for (size_t p = 1; p < partitions.size(); ++p)
+            bounds.push_back(*std::ranges::partition_point(std::views::iota(bounds.back(), m.size()),
+                                                           [&](size_t i) { return (*m.tags)[i] < first_tag(p); }));
+        bounds.push_back(m.size());
+        return slice_partitions(m, bounds);
+    }
+
+    // Materialize f(partition) for each partition, in parallel. f must keep
+    // the tags of each partition within its range, as applies, reductions and
+    // inner joins do.
+    template <typename F>
+    auto map_partitions(F f) const {
+        return map_partitions_indexed([&f](auto &df, size_t) { return f(df); });
+    }
+
+    // Like map_partitions, but also passes f the index of the partition.
+    template <typename F>
+    auto map_partitions_indexed(F f) const {
+        using Result = decltype(::to_dataframe(f(std::declval<DataFrame<_Tag, _Value> &>(), size_t(0))));
+        std::vector<Result> results(partitions.size());
+        parallel_for_each_index(partitions.size(), default_executor().concurrency(), [&](size_t p) {
+            auto df = partitions[p];
+            results[p] = ::to_dataframe(f(df, p));
+        });
+        return PartitionedDataFrame<typename Result::Tag, typename Result::Value>(results);
+    }
+
+    template <typename Op>
+    auto apply(Op op) const {
+        return map_partitions([op](auto &df) { return df.apply(op); });
+    }
+
+    template <typename... Ops>
+    auto reduce(Ops... ops) const {
+        return map_partitions([ops...](auto &df) { return df.reduce(ops...); });
+    }
+
+    auto reduce_sum() const {
+        return map_partitions([](auto &df) { return df.reduce_sum(); });
+    }
+
+    auto reduce_count() const {
+        return map_partitions([](auto &df) { return df.reduce_count(); });
+    }
+
+    auto reduce_mean() const {
+        return map_partitions([](auto &df) { return df.reduce_mean(); });
+    }
+
+    auto reduce_moments() const {
+        return map_partitions([](auto &df) { return df.reduce_moments(); });
+    }
+
+    auto reduce_var() const {
+        return map_partitions([](auto &df) { return df.reduce_var(); });
+    }
+
+    auto reduce_std() const {
+        return map_partitions([](auto &df) { return df.reduce_std(); });
+    }
+
+    auto reduce_max() const {
+        return map_partitions([](auto &df) { return df.reduce_max(); });
+    }
+
+    template <typename Op>
+    auto operator()(const Op &op) const {
+        return apply(op);
+    }
+
+    // For each partition of this dataframe, the partition of df_other whose
+    // range overlaps it, or df_other.num_partitions() if there's none.
+    // nullopt if a partition of either dataframe overlaps several of the
+    // other's.
+    template <typename TagOther, typename ValueOther>
+    std::optional<std::vector<size_t>> matching_partitions(
+        const PartitionedDataFrame<TagOther, ValueOther> &df_other) const {
+        size_t n = df_other.num_partitions();
+        std::vector<size_t> match(partitions.size(), n);
+        for (size_t p = 0, q = 0; p < partitions.size(); ++p) {
+            while (q < n && df_other.last_tag(q) < first_tag(p))
+                q++;
+            if (q == n || last_tag(p) < df_other.first_tag(q))
+                continue;
+            if ((q + 1 < n && !(last_tag(p) < df_other.first_tag(q + 1))) ||
+                (p + 1 < partitions.size() && !(df_other.last_tag(q) < first_tag(p + 1))))
+                return std::nullopt;
+            match[p] = q;
+        }
+        return match;
+    }
+
+    // Join with another partitioned dataframe, partition by partition. If
+    // df_other isn't partitioned like this dataframe, it's split like it first.
+    template <typename TagOther, typename ValueOther, typename CollateOp>
+    auto collate(const PartitionedDataFrame<TagOther, ValueOther> &df_other, CollateOp op) const {
+        if (auto match = matching_partitions(df_other))
+            return map_partitions_indexed([&](auto &df, size_t p) {
+                auto other = (*match)[p] < df_other.num_partitions() ? df_other.partitions[(*match)[p]]
+                                                                      : DataFrame<TagOther, ValueOther>();
+                return df.collate(other, op);
+            });
+        return collate(split_like(df_other.to_expr()), op);
+    }
+
+    // Join with a dataframe or expression, materialized and split like this
+    // one.
+    template <typename Df, typename CollateOp>
+    auto collate(Df df_other, CollateOp op) const {
+        return collate(split_like(df_other), op);
+    }
+
+    // The entries whose tags are in index, as with DataFrame::operator[].
+    template <typename Df>
+        requires(!std::is_integral_v<Df>)
+    auto operator[](const Df &index) const {
+        return collate(index, [](const auto &v, const auto &) { return v; });
+    }
+
+    // Entry i, counting across the partitions in order.
+    auto operator[](size_t i) const {
+        size_t p = 0;
+        for (; p + 1 < partitions.size() && i >= partitions[p].size(); ++p)
+            i -= partitions[p].size();
+        return partitions[p][i];
+    }
+
+    // These move entries between partitions, or interleave them with another
+    // dataframe's, so they stream the partitions through to_expr().
+
+    template <typename Arg>
+    auto retag(Arg tag_expr_or_op) const {
+        return to_expr().retag(unpartitioned(tag_expr_or_op));
+    }
+
+    template <typename Df>
+    auto concatenate(Df df_other) const {
+        return to_expr().concatenate(unpartitioned(df_other));
+    }
+
+    auto pipeline(size_t batch_size = 1024, size_t queue_depth = 8) const {
+        return to_expr().pipeline(batch_size, queue_depth);
+    }
+
+    template <typename Df, typename CollateOp>
+    auto collate_parallel(Df df_other, CollateOp op, size_t batch_size = 1024, size_t queue_depth = 8) const {
+        return to_expr().collate_parallel(unpartitioned(df_other), op, batch_size, queue_depth);
+    }
+
+    template <typename Df>
+    auto concatenate_parallel(Df df_other, size_t batch_size = 1024, size_t queue_depth = 8) const {
+        return to_expr().concatenate_parallel(unpartitioned(df_other), batch_size, queue_depth);
+    }
+
+    auto count_values() const { return materialize().count_values(); }
+
+    auto to_expr() const { return Expr_Partitions<_Tag, _Value>(partitions); }
+
+    auto materialize() const { return to_expr().materialize(); }
+
+    template <typename TagStorage, typename ValueStorage>
+    auto materialize_as() const {
+        return to_expr().template materialize_as<TagStorage, ValueStorage>();
+    }
+
+    auto materialize_run_length() const { return to_expr().materialize_run_length(); }
+
+    auto operator*() const { return materialize(); }
+
+    auto to_dataframe() const { return materialize(); }
+};
+
+// Split the rows of df, which must be sorted by tag, into at most
+// num_partitions partitions of about the same size. Runs of equal tags aren't
+// split across partitions.
+template <typename Df>
+auto partition_by_tag(Df df, size_t num_partitions) {
+    auto m = ::to_dataframe(df);
+    std::vector<size_t> bounds = {0};
+    for (size_t p = 1; p < num_partitions; ++p) {
+        size_t b = std::max(bounds.back(), m.size() * p / num_partitions);
+        while (b > bounds.back() && b < m.size() && !((*m.tags)[b - 1] < (*m.tags)[b]))
+            b++;
+        bounds.push_back(b);
+    }
+    bounds.push_back(m.size());
+    return slice_partitions(m, bounds);
+}
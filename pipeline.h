@@ -0,0 +1,202 @@
+#include <atomic>
+#include <bit>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A bounded lock-free queue for one producer thread and one consumer thread.
+// Blocked pushes and pops sleep on the queue's counters with atomic waits.
+template <typename T>
+struct SpscQueue {
+    std::vector<T> slots;
+    size_t mask;
+
+    // Both only ever grow. The producer writes tail and the consumer head, and
+    // they're on separate cache lines so the two threads don't contend for
+    // one line.
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    std::atomic<bool> cancelled = false;
+
+    SpscQueue(size_t capacity) : slots(std::bit_ceil(std::max<size_t>(capacity, 1))), mask(slots.size() - 1) {}
+
+    // Waits while the queue is full. Returns false if the consumer cancelled.
+    bool push(T v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        while (true) {
+            if (cancelled.load(std::memory_order_relaxed))
+                return false;
+            size_t h = head.load(std::memory_order_acquire);
+            if (t - h < slots.size())
+                break;
+            head.wait(h, std::memory_order_acquire);
+        }
+        slots[t & mask] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+        return true;
+    }
+
+    // Waits while the queue is empty.
+    T pop() {
+        size_t h = head.load(std::memory_order_relaxed);
+        for (size_t t; (t = tail.load(std::memory_order_acquire)) == h;)
+            tail.wait(t, std::memory_order_acquire);
+        T v = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        return v;
+    }
+
+    // Called by the consumer when it won't pop anymore. Makes the producer's
+    // pushes fail, and wakes it if it's waiting for room.
+    void cancel() {
+        cancelled = true;
+        head.fetch_add(1, std::memory_order_release);
+        head.notify_one();
+    }
+};
+
+/* Evaluates an expression on its own thread, ahead of the expression that
+consumes it.
+
+The thread evaluates batches of batch_size entries and passes them through a
+queue that holds up to queue_depth batches. Cutting a chain of operators
+with several of these makes each stage a thread, so the chain runs about as
+fast as its slowest stage rather than at the sum of their costs. Use it via
+Operations::pipeline(). For example,
+
+    df.apply(parse).pipeline().retag(key).pipeline().reduce_sum()
+
+runs the apply, the retag, and the reduction on three threads.
+
+The thread starts when the entries are first needed. Copies made before then
+evaluate the expression independently, each on its own thread, like copies
+of other expressions do. Copies made after share the same stream. The thread
+stops when the last copy sharing it is destroyed.
+*/
+template <typename Expr>
+struct Expr_Pipelined : Expr_Operations<Expr_Pipelined<Expr>> {
+    using Tag = std::decay_t<typename Expr::Tag>;
+    using Value = std::decay_t<typename Expr::Value>;
+    using Batch = std::vector<std::pair<Tag, Value>>;
+
+    struct Stage {
+        Expr expr;
+        SpscQueue<Batch> queue;
+        std::exception_ptr error;
+        std::thread thread;
+
+        // The batch the consumer is reading, and its position in it.
+        Batch batch;
+        size_t i = 0;
+        bool done = false;
+
+        // Whether the last advance_to_tag() didn't find its tag.
+        bool missed = false;
+
+        Stage(Expr _expr, size_t batch_size, size_t queue_depth) : expr(_expr), queue(queue_depth) {
+            thread = std::thread([this, batch_size] { produce(std::max<size_t>(batch_size, 1)); });
+        }
+
+        ~Stage() {
+            queue.cancel();
+            thread.join();
+        }
+
+        // An empty batch marks the end of the stream.
+        void produce(size_t batch_size) {
+            try {
+                while (!expr.end()) {
+                    Batch b;
+                    b.reserve(batch_size);
+                    for (; !expr.end() && b.size() < batch_size; expr.next())
+                        b.emplace_back(expr.tag(), expr.value());
+                    if (!queue.push(std::move(b)))
+                        return;
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+            queue.push(Batch());
+        }
+
+        // Fetch the next batch once the current one's used up. Rethrows what
+        // the expression threw.
+        void fill() {
+            while (!done && i == batch.size()) {
+                batch = queue.pop();
+                i = 0;
+                done = batch.empty();
+            }
+            if (done && error)
+                std::rethrow_exception(error);
+        }
+    };
+
+    Expr expr;
+    size_t batch_size;
+    size_t queue_depth;
+
+    // Started when the entries are first needed.
+    mutable std::shared_ptr<Stage> stage;
+
+    Expr_Pipelined(Expr _expr, size_t _batch_size = 1024, size_t _queue_depth = 8)
+        : expr(_expr), batch_size(_batch_size), queue_depth(_queue_depth) {}
+
+    Stage &started() const {
+        if (!stage) {
+            stage = std::make_shared<Stage>(expr, batch_size, queue_depth);
+            stage->fill();
+        }
+        return *stage;
+    }
+
+    const Tag &tag() const {
+        auto &s = started();
+        return s.batch[s.i].first;
+    }
+
+    const Value &value() const {
+        auto &s = started();
+        return s.batch[s.i].second;
+    }
+
+    void next() {
+        auto &s = started();
+        s.missed = false;
+        s.i++;
+        s.fill();
+    }
+
+    bool end() const {
+        auto &s = started();
+        return s.done || s.missed;
+    }
+
+    // Skips the entries before t. When t is missing, the expression reports
+    // its end, as Expr_DataFrame does, but stays at the first entry after t,
+    // so that later calls with larger tags, like the ones Expr_Intersection
+    // makes, still find theirs.
+    void advance_to_tag(Tag t) {
+        auto &s = started();
+        s.missed = false;
+        while (!s.done && s.batch[s.i].first < t)
+            next();
+        s.missed = !s.done && t < s.batch[s.i].first;
+    }
+};
+
+// Evaluate df on its own thread if it's an expression. Materialized
+// dataframes are left as they are, since reading them is cheap and they
+// support random access.
+template <typename Df>
+auto to_branch(Df df, size_t batch_size, size_t queue_depth) {
+    if constexpr (requires { df.tags; })
+        return ::to_expr(df);
+    else
+        return Expr_Pipelined<decltype(::to_expr(df))>(::to_expr(df), batch_size, queue_depth);
+}
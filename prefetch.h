@@ -0,0 +1,360 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define DATAFRAME_HAS_IO_URING
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef DATAFRAME_HAS_IO_URING
+// A minimal io_uring that submits reads and waits for their completions,
+// using the raw system calls so it doesn't need liburing. Throws if the
+// kernel doesn't support io_uring, or doesn't let this process use it.
+struct IoUring {
+    io_uring_params params = {};
+    int fd;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sq_ring_size, cq_ring_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+
+    IoUring(unsigned entries) : fd(syscall(__NR_io_uring_setup, entries, &params)) {
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), "io_uring_setup");
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring
+                              : ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe *>(::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                                                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                                  IORING_OFF_SQES));
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            int error = errno;
+            release();
+            throw std::system_error(error, std::system_category(), "io_uring mmap");
+        }
+
+        auto sq = static_cast<char *>(sq_ring);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        auto cq = static_cast<char *>(cq_ring);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring &) = delete;
+
+    ~IoUring() { release(); }
+
+    void release() {
+        if (sqes != MAP_FAILED)
+            ::munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            ::munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            ::munmap(sq_ring, sq_ring_size);
+        ::close(fd);
+    }
+
+    // Read size bytes at offset of file into buffer. The completion carries
+    // user_data. There can be at most `entries` reads in flight.
+    void submit_read(int file, char *buffer, unsigned size, uint64_t offset, uint64_t user_data) {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = size;
+        sqe.off = offset;
+        sqe.user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        while (syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) < 0)
+            if (errno != EINTR)
+                throw std::system_error(errno, std::system_category(), "io_uring_enter");
+    }
+
+    // Wait for the next read to complete.
+    io_uring_cqe wait_completion() {
+        while (true) {
+            unsigned head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe cqe = cqes[head & *cq_mask];
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return cqe;
+            }
+            if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+                throw std::system_error(errno, std::system_category(), "io_uring_enter");
+        }
+    }
+};
+#endif
+
+// Reads a file front to back in blocks of buffer_size bytes, keeping up to
+// queue_depth blocks in flight ahead of the block the caller is working on,
+// so reading the file overlaps with parsing it. Reads are issued through
+// io_uring when the kernel allows it, and by a reader thread otherwise.
+//
+// Block b is read into buffer b % queue_depth. The caller holds one block at
+// a time, and hands it back by asking for the next one.
+struct PrefetchingReader {
+    int fd;
+    size_t file_size;
+    size_t buffer_size;
+    size_t num_blocks;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    std::vector<size_t> sizes;
+
+    // The next block to hand to the caller.
+    size_t current = 0;
+
+#ifdef DATAFRAME_HAS_IO_URING
+    std::unique_ptr<IoUring> ring;
+    std::vector<bool> completed;
+    size_t in_flight = 0;
+#endif
+
+    // The reader thread fills blocks [filled, released + queue_depth).
+    std::thread reader;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t filled = 0;
+    size_t released = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    PrefetchingReader(const std::string &filename,
+                      size_t _buffer_size = 1 << 20,
+                      size_t queue_depth = 4,
+                      bool use_io_uring = true)
+        : fd(::open(filename.c_str(), O_RDONLY)), buffer_size(std::max<size_t>(_buffer_size, 1)) {
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), filename);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            throw std::system_error(errno, std::system_category(), filename);
+        }
+        file_size = st.st_size;
+        num_blocks = (file_size + buffer_size - 1) / buffer_size;
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        queue_depth = std::clamp<size_t>(queue_depth, 1, std::max<size_t>(num_blocks, 1));
+        for (size_t i = 0; i < queue_depth; ++i)
+            buffers.emplace_back(new char[buffer_size]);
+        sizes.resize(queue_depth);
+
+#ifdef DATAFRAME_HAS_IO_URING
+        if (use_io_uring && num_blocks > 0) {
+            try {
+                ring = std::make_unique<IoUring>(queue_depth);
+                completed.resize(queue_depth);
+                for (size_t b = 0; b < queue_depth; ++b)
+                    submit(b);
+                return;
+            } catch (const std::system_error &) {
+                drain();
+                ring.reset();
+            }
+        }
+#endif
+        reader = std::thread([this] { read_ahead(); });
+    }
+
+    PrefetchingReader(const PrefetchingReader &) = delete;
+
+    ~PrefetchingReader() {
+#ifdef DATAFRAME_HAS_IO_URING
+        // The kernel may still be writing into the buffers.
+        if (ring)
+            drain();
+#endif
+        if (reader.joinable()) {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            reader.join();
+        }
+        ::close(fd);
+    }
+
+    bool uses_io_uring() const {
+#ifdef DATAFRAME_HAS_IO_URING
+        return bool(ring);
+#else
+        return false;
+#endif
+    }
+
+    size_t queue_depth() const { return buffers.size(); }
+
+    // Read block b into its buffer. Returns how many bytes were read.
+    size_t read_block(size_t b, size_t already_read = 0) {
+        char *buffer = buffers[b % queue_depth()].get();
+        size_t size = std::min(buffer_size, file_size - b * buffer_size);
+        while (already_read < size) {
+            ssize_t n = ::pread(fd, buffer + already_read, size - already_read, b * buffer_size + already_read);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw std::system_error(errno, std::system_category(), "PrefetchingReader");
+            if (n == 0)
+                break;
+            already_read += n;
+        }
+        return already_read;
+    }
+
+    void read_ahead() {
+        try {
+            for (size_t b = 0; b < num_blocks; ++b) {
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&] { return stopping || b < released + queue_depth(); });
+                    if (stopping)
+                        return;
+                }
+                size_t n = read_block(b);
+                {
+                    std::lock_guard lock(mutex);
+                    sizes[b % queue_depth()] = n;
+                    filled = b + 1;
+                }
+                cv.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            error = std::current_exception();
+            cv.notify_all();
+        }
+    }
+
+#ifdef DATAFRAME_HAS_IO_URING
+    void submit(size_t b) {
+        if (b >= num_blocks)
+            return;
+        completed[b % queue_depth()] = false;
+        size_t size = std::min(buffer_size, file_size - b * buffer_size);
+        ring->submit_read(fd, buffers[b % queue_depth()].get(), size, b * buffer_size, b);
+        in_flight++;
+    }
+
+    // Wait until block b has been read.
+    void wait_for(size_t b) {
+        while (!completed[b % queue_depth()]) {
+            io_uring_cqe cqe = ring->wait_completion();
+            in_flight--;
+            size_t block = cqe.user_data;
+            // Finish short reads, and reads the kernel can't do asynchronously,
+            // with pread.
+            if (cqe.res < 0 && cqe.res != -EINVAL && cqe.res != -EOPNOTSUPP && cqe.res != -EAGAIN)
+                throw std::system_error(-cqe.res, std::system_category(), "PrefetchingReader");
+            sizes[block % queue_depth()] = read_block(block, std::max(cqe.res, 0));
+            completed[block % queue_depth()] = true;
+        }
+    }
+
+    void drain() {
+        while (in_flight > 0) {
+            ring->wait_completion();
+            in_flight--;
+        }
+    }
+#endif
+
+    // The next block of the file, or an empty view at the end of the file.
+    // The block is valid until the next call.
+    std::string_view next() {
+        if (current == num_blocks)
+            return {};
+        size_t slot = current % queue_depth();
+
+#ifdef DATAFRAME_HAS_IO_URING
+        if (ring) {
+            // Reuse the buffer of the block the caller is done with.
+            if (current > 0)
+                submit(current - 1 + queue_depth());
+            wait_for(current);
+            current++;
+            return std::string_view(buffers[slot].get(), sizes[slot]);
+        }
+#endif
+        std::unique_lock lock(mutex);
+        released = current;
+        cv.notify_all();
+        cv.wait(lock, [&] { return filled > current || error; });
+        if (filled <= current)
+            std::rethrow_exception(error);
+        current++;
+        return std::string_view(buffers[slot].get(), sizes[slot]);
+    }
+};
+
+// Splits the blocks of a PrefetchingReader into lines.
+struct PrefetchingLineReader {
+    PrefetchingReader blocks;
+    std::string_view block;
+    std::string line;
+
+    PrefetchingLineReader(const std::string &filename, size_t buffer_size = 1 << 20, size_t queue_depth = 4)
+        : blocks(filename, buffer_size, queue_depth) {}
+
+    // The next line, including its newline. Empty at the end of the file. The
+    // line is only valid until the next call. Lines that span blocks are
+    // copied into a buffer.
+    std::string_view next_line() {
+        line.clear();
+        while (true) {
+            auto newline =
+                block.empty() ? nullptr : static_cast<const char *>(std::memchr(block.data(), '\n', block.size()));
+            if (newline) {
+                size_t length = newline - block.data() + 1;
+                std::string_view head = block.substr(0, length);
+                block.remove_prefix(length);
+                if (line.empty())
+                    return head;
+                line += head;
+                return line;
+            }
+            line += block;
+            block = blocks.next();
+            if (block.empty())
+                return line;
+        }
+    }
+};
@@ -0,0 +1,117 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <system_error>
+
+/* Dataframes shared between processes through POSIX shared memory.
+
+share_dataframe() copies a dataframe in binary format into a new named
+shared-memory object, and attach_dataframe() maps it read-only into any
+process on the machine, as a dataframe whose trivially copyable tags and values
+are Mapped arrays that point straight into the shared pages. However many
+processes attach, the machine holds one copy of those columns. String columns
+are copied into each process's StringArenas.
+
+Every process that has a dataframe attached to the object holds a shared
+lock on it. When the last dataframe in a process that refers to the object
+is destroyed, the process tries to upgrade to an exclusive lock, which only
+succeeds when no other process is still attached, and in that case removes
+the object, unless the name now refers to a different object. The kernel
+releases the locks of processes that exit, including ones that crash, so the
+count of attached processes can't leak.
+unlink_shared_dataframe() removes an object by name regardless.
+*/
+
+// A mapping of a shared-memory object that holds a shared lock on it, and
+// removes the object if it's the last one attached when it's destroyed.
+struct SharedMemoryFile : MappedFile {
+    std::string name;
+
+    SharedMemoryFile(int fd, const std::string &_name) : MappedFile(lock_shared(fd, _name), _name), name(_name) {}
+
+    ~SharedMemoryFile() {
+        if (::flock(fd, LOCK_EX | LOCK_NB) == 0 && still_named())
+            ::shm_unlink(name.c_str());
+    }
+
+    // Whether name still refers to the object this file maps, rather than
+    // to a new object that was shared under the same name after this one was
+    // unlinked.
+    bool still_named() const {
+        int named_fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        if (named_fd < 0)
+            return false;
+        struct stat held, named;
+        bool same = ::fstat(fd, &held) == 0 && ::fstat(named_fd, &named) == 0 && held.st_ino == named.st_ino &&
+                    held.st_dev == named.st_dev;
+        ::close(named_fd);
+        return same;
+    }
+
+    static int lock_shared(int fd, const std::string &name) {
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), name);
+        if (::flock(fd, LOCK_SH) < 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::system_category(), name);
+        }
+        return fd;
+    }
+};
+
+// Attach to the dataframe that share_dataframe() put in the shared-memory
+// object called name. Tag and Value are the storage types it was shared with.
+template <typename Tag, typename Value>
+auto attach_dataframe(const std::string &name, bool verify_checksums = false) {
+    auto file = std::make_shared<SharedMemoryFile>(::shm_open(name.c_str(), O_RDONLY, 0), name);
+    return read_binary<Tag, Value>(file, name, verify_checksums);
+}
+
+// Copy df into a new shared-memory object called name, which must start with
+// a '/' and not exist yet. Returns the dataframe attached to the object.
+template <typename Tag, typename Value>
+auto share_dataframe(const DataFrame<Tag, Value> &df, const std::string &name) {
+    int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), name);
+
+    // Hold a shared lock while writing, and until the returned dataframe holds
+    // its own, so that a process that attaches to the object before it's
+    // complete, and fails, can't remove it.
+    auto lock = std::unique_ptr<int, void (*)(int *)>(&fd, [](int *fd) { ::close(*fd); });
+    try {
+        if (::flock(fd, LOCK_SH) < 0)
+            throw std::system_error(errno, std::system_category(), name);
+        int write_fd = ::dup(fd);
+        auto f = std::unique_ptr<FILE, decltype(&std::fclose)>(write_fd < 0 ? nullptr : ::fdopen(write_fd, "wb"),
+                                                               &std::fclose);
+        if (!f) {
+            int error = errno;
+            if (write_fd >= 0)
+                ::close(write_fd);
+            throw std::system_error(error, std::system_category(), name);
+        }
+        write_binary(df, f.get(), name);
+        if (std::fclose(f.release()) != 0)
+            throw std::system_error(errno, std::system_category(), name);
+        return attach_dataframe<typename BinaryStorage<Tag>::type, typename BinaryStorage<Value>::type>(name);
+    } catch (...) {
+        ::shm_unlink(name.c_str());
+        throw;
+    }
+}
+
+// Remove the shared-memory object called name. Processes that are attached to
+// it keep their mappings.
+inline void unlink_shared_dataframe(const std::string &name) {
+    if (::shm_unlink(name.c_str()) < 0 && errno != ENOENT)
+        throw std::system_error(errno, std::system_category(), name);
+}
@@ -0,0 +1,507 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Write all of data to the socket fd.
+inline void send_all(int fd, const void *data, size_t size) {
+    auto p = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::system_error(errno, std::system_category(), "shuffle: send");
+        p += n;
+        size -= n;
+    }
+}
+
+// Read exactly size bytes from the socket fd.
+inline void receive_all(int fd, void *data, size_t size) {
+    auto p = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::system_error(errno, std::system_category(), "shuffle: recv");
+        if (n == 0)
+            throw std::runtime_error("shuffle: a worker exited before sending all its rows");
+        p += n;
+        size -= n;
+    }
+}
+
+// Messages on the sockets are a 64-bit length followed by that many bytes.
+inline void send_message(int fd, const std::string &message) {
+    uint64_t n = message.size();
+    send_all(fd, &n, sizeof(n));
+    send_all(fd, message.data(), n);
+}
+
+inline std::string receive_message(int fd) {
+    uint64_t n;
+    receive_all(fd, &n, sizeof(n));
+    std::string message(n, '\0');
+    receive_all(fd, message.data(), n);
+    return message;
+}
+
+// The type a shuffle stores tags or values of type T as. Views of strings
+// are sent as the strings themselves.
+template <typename T>
+using ShuffleType = std::conditional_t<std::is_same_v<T, std::string_view>, std::string, T>;
+
+template <typename T>
+constexpr bool is_shuffleable = std::is_trivially_copyable_v<T> || std::is_same_v<T, std::string>;
+
+// Append v to out as a count followed by the entries. Trivially copyable
+// entries are copied as they're laid out in memory, and strings as their
+// length followed by their characters.
+template <typename T>
+void serialize(std::string &out, const std::vector<T> &v) {
+    static_assert(is_shuffleable<T>, "shuffles only support trivially copyable or string tags and values");
+    uint64_t n = v.size();
+    out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+    if constexpr (std::is_same_v<T, std::string>) {
+        for (const auto &s : v) {
+            uint64_t length = s.size();
+            out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            out.append(s);
+        }
+    } else
+        out.append(reinterpret_cast<const char *>(v.data()), n * sizeof(T));
+}
+
+// Reads back what serialize() wrote.
+struct ShuffleReader {
+    std::string_view bytes;
+
+    void read(void *data, size_t size) {
+        if (size == 0)
+            return;  // data may be null for an empty array.
+        if (size > bytes.size())
+            throw std::runtime_error("shuffle: truncated message");
+        std::memcpy(data, bytes.data(), size);
+        bytes.remove_prefix(size);
+    }
+
+    template <typename T>
+    std::vector<T> read_array() {
+        uint64_t n;
+        read(&n, sizeof(n));
+        std::vector<T> v;
+        if constexpr (std::is_same_v<T, std::string>) {
+            for (uint64_t i = 0; i < n; ++i) {
+                uint64_t length;
+                read(&length, sizeof(length));
+                if (length > bytes.size())
+                    throw std::runtime_error("shuffle: truncated message");
+                v.emplace_back(bytes.substr(0, length));
+                bytes.remove_prefix(length);
+            }
+        } else {
+            if (n > bytes.size() / sizeof(T))
+                throw std::runtime_error("shuffle: truncated message");
+            v.resize(n);
+            read(v.data(), n * sizeof(T));
+        }
+        return v;
+    }
+};
+
+// Sends each tag to worker hash(tag) % num_workers.
+struct HashPartitioner {
+    template <typename Tag>
+    size_t operator()(const Tag &t, size_t num_workers) const {
+        return std::hash<Tag>()(t) % num_workers;
+    }
+};
+
+// Sends the tags below splitters[0] to worker 0, the tags from splitters[0]
+// up to splitters[1] to worker 1, and so on. Unlike hashing, this leaves each
+// worker with a contiguous range of tags.
+template <typename Tag>
+struct RangePartitioner {
+    std::vector<Tag> splitters;
+
+    size_t operator()(const Tag &t, size_t num_workers) const {
+        size_t p = std::upper_bound(splitters.begin(), splitters.end(), t) - splitters.begin();
+        return std::min(p, num_workers - 1);
+    }
+};
+
+// The input of a shuffle is either a materialized dataframe, whose rows are
+// dealt to the workers in contiguous slices, or a function f(worker,
+// num_workers) that returns the dataframe or expression that worker reads.
+template <typename Input>
+struct ShuffleInput {
+    using Expr = decltype(::to_expr(std::declval<std::invoke_result_t<Input &, size_t, size_t> &>()));
+    using Tag = ShuffleType<std::decay_t<typename Expr::Tag>>;
+    using Value = ShuffleType<std::decay_t<typename Expr::Value>>;
+
+    template <typename F>
+    static void for_each_row(Input &input, size_t worker, size_t num_workers, F f) {
+        auto df = input(worker, num_workers);
+        for (auto expr = ::to_expr(df); !expr.end(); expr.next())
+            f(expr.tag(), expr.value());
+    }
+};
+
+template <typename _Tag, typename _Value>
+struct ShuffleInput<DataFrame<_Tag, _Value>> {
+    using Tag = ShuffleType<std::decay_t<typename DataFrame<_Tag, _Value>::Tag>>;
+    using Value = ShuffleType<std::decay_t<typename DataFrame<_Tag, _Value>::Value>>;
+
+    template <typename F>
+    static void for_each_row(const DataFrame<_Tag, _Value> &df, size_t worker, size_t num_workers, F f) {
+        for (size_t i = df.size() * worker / num_workers; i < df.size() * (worker + 1) / num_workers; ++i) {
+            auto [t, v] = df[i];
+            f(t, v);
+        }
+    }
+};
+
+// Unix domain sockets connecting every pair of workers. Worker s writes to
+// worker d through sockets[s][d][0], and d reads from sockets[s][d][1].
+struct ShuffleMesh {
+    size_t num_workers;
+    std::vector<std::vector<std::array<int, 2>>> sockets;
+
+    ShuffleMesh(size_t _num_workers)
+        : num_workers(_num_workers),
+          sockets(num_workers, std::vector<std::array<int, 2>>(num_workers, std::array<int, 2>{-1, -1})) {
+        for (size_t s = 0; s < num_workers; ++s)
+            for (size_t d = 0; d < num_workers; ++d)
+                if (s != d && ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[s][d].data()) < 0) {
+                    int error = errno;
+                    close_all_except(num_workers);
+                    throw std::system_error(error, std::system_category(), "shuffle: socketpair");
+                }
+    }
+
+    // Close the sockets that worker w doesn't use, so that a worker that
+    // exits early closes its connections and its peers see the end of the
+    // stream rather than waiting forever. The parent passes num_workers to
+    // close them all.
+    void close_all_except(size_t w) {
+        for (size_t s = 0; s < num_workers; ++s)
+            for (size_t d = 0; d < num_workers; ++d)
+                for (int end = 0; end < 2; ++end) {
+                    int &fd = sockets[s][d][end];
+                    bool used = (end == 0 && s == w) || (end == 1 && d == w);
+                    if (fd >= 0 && !used) {
+                        ::close(fd);
+                        fd = -1;
+                    }
+                }
+    }
+};
+
+// Send outgoing[d] to worker d, for every worker d other than w, and return
+// the messages the other workers send to w, with outgoing[w] standing in for
+// the one from w itself. Runs on one thread, polling the sockets so that
+// sends and receives proceed together and the workers can't deadlock with
+// full socket buffers.
+inline std::vector<std::string> exchange_messages(ShuffleMesh &mesh, size_t w, std::vector<std::string> outgoing) {
+    size_t n = mesh.num_workers;
+
+    // A message's length goes out ahead of it.
+    std::vector<uint64_t> out_lengths(n);
+    std::vector<size_t> sent(n, 0);
+    for (size_t d = 0; d < n; ++d)
+        out_lengths[d] = outgoing[d].size();
+
+    std::vector<uint64_t> in_lengths(n, 0);
+    std::vector<std::string> incoming(n);
+    std::vector<size_t> received(n, 0);
+    auto sending = [&](size_t d) { return d != w && sent[d] < sizeof(uint64_t) + outgoing[d].size(); };
+    auto receiving = [&](size_t s) {
+        return s != w && (received[s] < sizeof(uint64_t) || received[s] < sizeof(uint64_t) + in_lengths[s]);
+    };
+
+    while (true) {
+        // fds[k] is the socket of peers[k], and sends if k < num_sends.
+        std::vector<pollfd> fds;
+        std::vector<size_t> peers;
+        for (size_t d = 0; d < n; ++d)
+            if (sending(d)) {
+                fds.push_back({mesh.sockets[w][d][0], POLLOUT, 0});
+                peers.push_back(d);
+            }
+        size_t num_sends = fds.size();
+        for (size_t s = 0; s < n; ++s)
+            if (receiving(s)) {
+                fds.push_back({mesh.sockets[s][w][1], POLLIN, 0});
+                peers.push_back(s);
+            }
+        if (fds.empty())
+            break;
+
+        if (::poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::system_category(), "shuffle: poll");
+        }
+
+        for (size_t k = 0; k < fds.size(); ++k) {
+            if (!fds[k].revents)
+                continue;
+            size_t peer = peers[k];
+            if (k < num_sends) {
+                // Send the rest of the length, or else the rest of the message.
+                size_t &done = sent[peer];
+                const char *p = done < sizeof(uint64_t) ? reinterpret_cast<const char *>(&out_lengths[peer]) + done
+                                                        : outgoing[peer].data() + (done - sizeof(uint64_t));
+                size_t size = done < sizeof(uint64_t) ? sizeof(uint64_t) - done
+                                                      : outgoing[peer].size() - (done - sizeof(uint64_t));
+                ssize_t m = ::send(fds[k].fd, p, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (m < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                    throw std::system_error(errno, std::system_category(), "shuffle: send");
+                if (m > 0)
+                    done += m;
+            } else {
+                size_t &done = received[peer];
+                char *p;
+                size_t size;
+                if (done < sizeof(uint64_t)) {
+                    p = reinterpret_cast<char *>(&in_lengths[peer]) + done;
+                    size = sizeof(uint64_t) - done;
+                } else {
+                    p = incoming[peer].data() + (done - sizeof(uint64_t));
+                    size = in_lengths[peer] - (done - sizeof(uint64_t));
+                }
+                ssize_t m = ::recv(fds[k].fd, p, size, MSG_DONTWAIT);
+                if (m < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                    throw std::system_error(errno, std::system_category(), "shuffle: recv");
+                if (m == 0)
+                    throw std::runtime_error("shuffle: a worker exited before sending all its rows");
+                if (m > 0) {
+                    done += m;
+                    if (done == sizeof(uint64_t))
+                        incoming[peer].resize(in_lengths[peer]);
+                }
+            }
+        }
+    }
+
+    incoming[w] = std::move(outgoing[w]);
+    return incoming;
+}
+
+// Send worker w's rows of input to the workers that partition assigns them
+// to, and collect the rows the workers send to w, sorted by tag. Rows with
+// equal tags keep the order of the workers that sent them.
+template <typename Input, typename Partitioner>
+auto exchange_rows(Input &input, size_t w, ShuffleMesh &mesh, const Partitioner &partition) {
+    using Tag = typename ShuffleInput<Input>::Tag;
+    using Value = typename ShuffleInput<Input>::Value;
+    size_t n = mesh.num_workers;
+
+    std::vector<std::vector<Tag>> tags(n);
+    std::vector<std::vector<Value>> values(n);
+    ShuffleInput<Input>::for_each_row(input, w, n, [&](const auto &t, const auto &v) {
+        size_t d = partition(t, n);
+        tags[d].emplace_back(t);
+        values[d].emplace_back(v);
+    });
+
+    std::vector<std::string> outgoing(n);
+    for (size_t d = 0; d < n; ++d) {
+        serialize(outgoing[d], tags[d]);
+        serialize(outgoing[d], values[d]);
+    }
+    tags.clear();
+    values.clear();
+    auto incoming = exchange_messages(mesh, w, std::move(outgoing));
+
+    std::vector<Tag> received_tags;
+    std::vector<Value> received_values;
+    for (size_t s = 0; s < n; ++s) {
+        ShuffleReader reader{incoming[s]};
+        for (auto &t : reader.read_array<Tag>())
+            received_tags.push_back(std::move(t));
+        for (auto &v : reader.read_array<Value>())
+            received_values.push_back(std::move(v));
+        if (received_tags.size() != received_values.size())
+            throw std::runtime_error("shuffle: received different numbers of tags and values");
+        std::string().swap(incoming[s]);
+    }
+
+    std::vector<size_t> order;
+    argsort(received_tags, order);
+    DataFrame<Tag, Value> df;
+    df.tags->reserve(order.size());
+    df.values->reserve(order.size());
+    for (size_t i : order) {
+        df.tags->push_back(std::move(received_tags[i]));
+        df.values->push_back(std::move(received_values[i]));
+    }
+    return df;
+}
+
+/* Run a shuffle on num_workers local worker processes, the way a cluster
+would run it on num_workers machines.
+
+Each worker is a forked copy of this process. Worker w reads its share of
+each input, sends each row to the worker that partition(tag, num_workers)
+names over Unix domain sockets, and receives the rows that are sent to it, so
+all the rows with the same tag end up on the same worker. It then evaluates
+local_op on the dataframes of rows it received, one per input, and sends the
+result back to this process, which merges the workers' results in tag order.
+
+local_op typically reduces its input or collates two inputs. It mustn't
+send a tag to a worker other than the one its rows were sent to, which
+reductions and collations don't. The tags and values of the inputs and of
+local_op's result must be trivially copyable or strings. Strings are sent as
+their characters, and the dataframes local_op receives store them as
+std::strings. For example, a distributed group-by is
+
+    shuffle(8, HashPartitioner(), [](auto &df) { return df.reduce_sum(); }, df);
+
+Workers are forked from a process that may be running other threads, like the
+ThreadPool of default_executor(). Those threads don't exist in the workers, so
+a worker exchanges rows on its one thread, runs operations that use the
+default executor on a SerialExecutor, and exits with _exit(). local_op
+mustn't start threads of its own or use an execution policy. Throws if a
+worker fails, with the worker's exception message.
+*/
+template <typename Partitioner, typename LocalOp, typename... Inputs>
+auto shuffle(size_t num_workers, Partitioner partition, LocalOp local_op, Inputs... inputs) {
+    using Partitions =
+        std::tuple<DataFrame<typename ShuffleInput<Inputs>::Tag, typename ShuffleInput<Inputs>::Value>...>;
+    using Result = decltype(::to_dataframe(std::apply(local_op, std::declval<Partitions &>())));
+    using Tag = ShuffleType<std::decay_t<typename Result::Tag>>;
+    using Value = ShuffleType<std::decay_t<typename Result::Value>>;
+
+    num_workers = std::max<size_t>(num_workers, 1);
+    ShuffleMesh mesh(num_workers);
+
+    // Each worker sends its result to this process through results[w].
+    std::vector<std::array<int, 2>> results(num_workers, std::array<int, 2>{-1, -1});
+    std::vector<pid_t> pids;
+    auto close_results = [&] {
+        for (auto &result : results)
+            for (int fd : result)
+                if (fd >= 0)
+                    ::close(fd);
+    };
+    for (size_t w = 0; w < num_workers; ++w) {
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, results[w].data()) < 0) {
+            int error = errno;
+            close_results();
+            mesh.close_all_except(num_workers);
+            throw std::system_error(error, std::system_category(), "shuffle: socketpair");
+        }
+    }
+
+    for (size_t w = 0; w < num_workers; ++w) {
+        pid_t pid = ::fork();
+        if (pid < 0)
+            break;
+        if (pid > 0) {
+            pids.push_back(pid);
+            continue;
+        }
+
+        // The worker. Nothing may leave this block other than through
+        // _exit(), or the worker would go on to run the rest of the caller.
+        int out = results[w][1];
+        int status = 0;
+        try {
+            // The parent's other threads weren't copied into the worker, so
+            // it mustn't wait on them.
+            static SerialExecutor serial_executor;
+            set_default_executor(&serial_executor);
+            mesh.close_all_except(w);
+            for (size_t v = 0; v < num_workers; ++v) {
+                ::close(results[v][0]);
+                if (v != w)
+                    ::close(results[v][1]);
+            }
+
+            // Braced initialization exchanges the inputs one at a time, in order.
+            Partitions partitions{exchange_rows(inputs, w, mesh, partition)...};
+            auto result = ::to_dataframe(std::apply(local_op, partitions));
+            std::vector<Tag> tags;
+            std::vector<Value> values;
+            for (size_t i = 0; i < result.size(); ++i) {
+                auto [t, v] = result[i];
+                tags.emplace_back(t);
+                values.emplace_back(v);
+            }
+            std::string message(1, '\0');
+            serialize(message, tags);
+            serialize(message, values);
+            send_message(out, message);
+        } catch (const std::exception &e) {
+            status = 1;
+            try {
+                send_message(out, '\1' + std::string(e.what()));
+            } catch (...) {
+            }
+        } catch (...) {
+            status = 1;
+            try {
+                send_message(out, "\1unknown exception");
+            } catch (...) {
+            }
+        }
+        ::_exit(status);
+    }
+
+    mesh.close_all_except(num_workers);
+    for (auto &result : results) {
+        ::close(result[1]);
+        result[1] = -1;
+    }
+
+    std::vector<DataFrame<Tag, Value>> runs(pids.size());
+    std::string error = pids.size() < num_workers ? "shuffle: couldn't fork a worker" : "";
+    for (size_t w = 0; w < pids.size(); ++w) {
+        try {
+            // The first byte of a worker's message says whether it succeeded.
+            auto message = receive_message(results[w][0]);
+            if (message.empty())
+                throw std::runtime_error("shuffle: empty message");
+            if (message[0] == 0) {
+                ShuffleReader reader{std::string_view(message).substr(1)};
+                *runs[w].tags = reader.read_array<Tag>();
+                *runs[w].values = reader.read_array<Value>();
+            } else if (error.empty())
+                error = "shuffle: worker " + std::to_string(w) + ": " + message.substr(1);
+        } catch (const std::exception &e) {
+            if (error.empty())
+                error = "shuffle: worker " + std::to_string(w) + ": " + e.what();
+        }
+        // Stop a worker that's blocked on its peers, so waiting on it below
+        // can't hang.
+        if (!error.empty())
+            for (pid_t pid : pids)
+                ::kill(pid, SIGKILL);
+    }
+    close_results();
+    for (pid_t pid : pids)
+        ::waitpid(pid, nullptr, 0);
+    if (!error.empty())
+        throw std::runtime_error(error);
+
+    return Expr_MergedRuns<Tag, Value>(runs).template materialize_as<Tag, Value>();
+}
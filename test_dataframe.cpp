@@ -2,12 +2,25 @@
 Compile this demo with
 
    clang++ -Wall -std=c++2b  test_dataframe2.cpp  -lgtest_main -lgtest
+
+Add -llz4 -lzstd when lz4.h and zstd.h are installed. To test the execution
+policies too, add -DDATAFRAME_WITH_EXECUTION_POLICIES -ltbb when TBB is
+installed.
 */
 
 #include <gtest/gtest.h>
+#include <sys/wait.h>
 
+#include <filesystem>
+#include <latch>
 #include <string>
 
+#if __has_include(<lz4.h>)
+#define DATAFRAME_WITH_LZ4
+#endif
+#if __has_include(<zstd.h>)
+#define DATAFRAME_WITH_ZSTD
+#endif
 #include "dataframe.h"
 
 TEST(DataFrame, copy_by_reference) {
@@ -487,6 +500,202 @@ TEST(RangeTags, Indexing) {
     EXPECT_EQ(*c.values, (std::vector<int>{-3, -4}));
 }
 
+TEST(RunLengthTags, runs) {
+    auto df = DataFrame<RunLengthTag<int>, float>({1, 1, 1, 2, 5, 5}, {10., 11., 12., 20., 50., 51.});
+
+    EXPECT_EQ(df.size(), 6);
+    EXPECT_EQ(df.tags->runs, (std::vector<std::pair<int, size_t>>{{1, 3}, {2, 4}, {5, 6}}));
+    EXPECT_EQ(df[2].t, 1);
+    EXPECT_EQ(df[3].t, 2);
+    EXPECT_EQ(df[4].t, 5);
+    EXPECT_EQ(df[4].v, 50.);
+}
+
+TEST(RunLengthTags, expression) {
+    auto df = DataFrame<RunLengthTag<int>, float>({1, 1, 2, 5, 5}, {10., 11., 20., 50., 51.});
+    auto g = df.to_expr().materialize();
+
+    EXPECT_EQ(*g.tags, (std::vector<int>{1, 1, 2, 5, 5}));
+    EXPECT_EQ(*g.values, (std::vector<float>{10., 11., 20., 50., 51.}));
+}
+
+TEST(RunLengthTags, advance_to_tag) {
+    auto df = DataFrame<RunLengthTag<int>, float>({1, 1, 2, 5, 5}, {10., 11., 20., 50., 51.});
+    auto edf = to_expr(df);
+
+    edf.advance_to_tag(5);
+    EXPECT_EQ(edf.i, 3);
+    EXPECT_EQ(edf.tag(), 5);
+    EXPECT_EQ(edf.run_remaining(), 2);
+
+    edf.advance_to_tag(3);
+    EXPECT_TRUE(edf.end());
+}
+
+TEST(RunLengthTags, reduce_sum) {
+    auto df = DataFrame<RunLengthTag<int>, float>({1, 1, 2, 5, 5, 5}, {10., 11., 20., 50., 51., 52.});
+
+    auto g = df.apply([](float v) { return 2 * v; }).reduce_sum().materialize();
+
+    EXPECT_EQ(*g.tags, (std::vector<int>{1, 2, 5}));
+    EXPECT_EQ(*g.values, (std::vector<float>{42., 40., 306.}));
+}
+
+TEST(RunLengthTags, materialize_run_length) {
+    auto df = DataFrame<std::string, float>({"a", "b", "c", "d"}, {2., 1., 2., 1.});
+    auto g = df.retag([](const std::string &, float v) { return int(v); }).materialize_run_length();
+
+    EXPECT_EQ(g.tags->runs, (std::vector<std::pair<int, size_t>>{{1, 2}, {2, 4}}));
+    EXPECT_EQ(*g.values, (std::vector<float>{1., 1., 2., 2.}));
+
+    auto c = *g[DataFrame<int, ConstantValue<int>>({2}, {0})];
+    EXPECT_EQ(*c.tags, (std::vector<int>{2}));
+    EXPECT_EQ(*c.values, (std::vector<float>{2.}));
+}
+
+TEST(Categorical, values) {
+    auto df = DataFrame<RangeTag, Categorical<std::string>>({4}, {"ali", "john", "ali", "misha"});
+
+    EXPECT_EQ(df.values->dictionary->values, (std::vector<std::string>{"ali", "john", "misha"}));
+    EXPECT_EQ(df.values->codes, (std::vector<uint32_t>{0, 1, 0, 2}));
+    EXPECT_EQ(df[2].v, "ali");
+    EXPECT_EQ(df[3].v, "misha");
+}
+
+TEST(Categorical, shared_dictionary) {
+    auto dictionary = std::make_shared<Dictionary<std::string>>();
+    auto df1 = DataFrame<RangeTag, Categorical<std::string>>({2}, {dictionary});
+    auto df2 = DataFrame<RangeTag, Categorical<std::string>>({2}, {dictionary});
+    df1.values->push_back("ali");
+    df1.values->push_back("john");
+    df2.values->push_back("john");
+    df2.values->push_back("ali");
+
+    EXPECT_EQ(df1.values->dictionary, df2.values->dictionary);
+    EXPECT_EQ(df2.values->codes, (std::vector<uint32_t>{1, 0}));
+}
+
+TEST(Categorical, apply_once_per_value) {
+    auto df = DataFrame<int, Categorical<std::string>>({1, 2, 3, 4}, {"ali", "john", "ali", "ali"});
+
+    int num_calls = 0;
+    auto g = df.apply([&num_calls](const std::string &v) {
+        num_calls++;
+        return v.size();
+    });
+
+    EXPECT_EQ(num_calls, 2);
+    EXPECT_EQ(g.df.tags, df.tags);
+    EXPECT_EQ(*g.materialize().values, (std::vector<size_t>{3, 4, 3, 3}));
+}
+
+TEST(Categorical, collate_once_per_pair) {
+    auto df1 = DataFrame<int, Categorical<std::string>>({1, 2, 3, 4}, {"a", "b", "a", "a"});
+    auto df2 = DataFrame<int, Categorical<std::string>>({1, 2, 3, 4}, {"x", "y", "x", "y"});
+
+    int num_calls = 0;
+    auto g = *df1.collate(df2, [&num_calls](const std::string &v1, const std::string &v2) {
+        num_calls++;
+        return v1 + v2;
+    });
+
+    EXPECT_EQ(num_calls, 3);
+    EXPECT_EQ(*g.tags, (std::vector<int>{1, 2, 3, 4}));
+    EXPECT_EQ(*g.values, (std::vector<std::string>{"ax", "by", "ax", "ay"}));
+}
+
+TEST(Categorical, count_values) {
+    auto df = DataFrame<RangeTag, Categorical<std::string>>({5}, {"misha", "ali", "john", "ali", "misha"});
+    auto g = df.count_values().materialize();
+
+    EXPECT_EQ(*g.tags, (std::vector<std::string>{"ali", "john", "misha"}));
+    EXPECT_EQ(*g.values, (std::vector<int>{2, 1, 2}));
+}
+
+TEST(StringArena, storage) {
+    auto df = DataFrame<RangeTag, StringArena>({3}, {"ali", "", "misha"});
+
+    EXPECT_EQ(df.values->bytes, "alimisha");
+    EXPECT_EQ(df.values->offsets, (std::vector<size_t>{0, 3, 3, 8}));
+    EXPECT_EQ(df[0].v, "ali");
+    EXPECT_EQ(df[1].v, "");
+    EXPECT_EQ(df[2].v, "misha");
+}
+
+TEST(StringArena, tags) {
+    auto df = DataFrame<StringArena, float>({"ali", "john", "misha"}, {1., 2., 3.});
+    auto edf = to_expr(df);
+
+    edf.advance_to_tag("john");
+    EXPECT_EQ(edf.tag(), "john");
+    EXPECT_EQ(edf.value(), 2.);
+
+    auto g = *df.apply([](std::string_view t, float v) { return t.size() * v; });
+    EXPECT_EQ(g.tags->bytes, "alijohnmisha");
+    EXPECT_EQ(*g.values, (std::vector<float>{3., 8., 15.}));
+}
+
+TEST(StringArena, materialize_copies_strings) {
+    auto df = DataFrame<RangeTag, StringArena>({3}, {"john", "ali", "john"});
+    auto g = *df.apply([](std::string_view v) { return v.substr(1); });
+    df.values->bytes.assign(df.values->bytes.size(), '?');
+
+    EXPECT_NE(g.values, df.values);
+    EXPECT_EQ(g.values->bytes, "ohnliohn");
+}
+
+TEST(StringArena, count_values) {
+    auto df = DataFrame<RangeTag, StringArena>({4}, {"john", "ali", "john", "misha"});
+    auto g = df.count_values().materialize();
+
+    EXPECT_EQ(g.tags->bytes, "alijohnmisha");
+    EXPECT_EQ(*g.values, (std::vector<int>{1, 2, 1}));
+}
+
+TEST(StringArena, read_tsv) {
+    auto filename = testing::TempDir() + "string_arena.tsv";
+    std::ofstream(filename) << "name\tage\nali\t10\njohn\t20\n";
+
+    auto df = read_tsv<StringArena>(filename);
+
+    EXPECT_EQ(df.size(), 2);
+    EXPECT_EQ(df.values->bytes, "alijohn");
+    EXPECT_EQ(df[1].v, "john");
+}
+
+TEST(MemoryUsage, bytes) {
+    auto df = DataFrame<int, float>({1, 2, 3, 4}, {10., 20., 30., 40.});
+    auto usage = df.memory_usage();
+
+    EXPECT_EQ(usage.tag_bytes, sizeof(std::vector<int>) + 4 * sizeof(int));
+    EXPECT_EQ(usage.value_bytes, sizeof(std::vector<float>) + 4 * sizeof(float));
+    EXPECT_EQ(usage.tag_share_count, 1);
+
+    auto df_copy = df;
+    auto e = df.to_expr();
+    EXPECT_EQ(df.memory_usage().tag_share_count, 3);
+    EXPECT_EQ(df.memory_usage().value_share_count, 3);
+}
+
+TEST(MemoryUsage, storage_types) {
+    std::vector<int> tags(1000, 7);
+    auto plain = DataFrame<int, ConstantValue<int>>(tags, {0});
+    auto run_length = DataFrame<RunLengthTag<int>, ConstantValue<int>>(tags, {0});
+    auto range = DataFrame<RangeTag, ConstantValue<int>>({1000}, {0});
+
+    EXPECT_EQ(range.memory_usage().tag_bytes, sizeof(std::vector<RangeTag>));
+    EXPECT_LT(100 * run_length.memory_usage().tag_bytes, plain.memory_usage().tag_bytes);
+}
+
+TEST(MemoryUsage, strings) {
+    std::string long_string(100, 'x');
+    auto strings = DataFrame<RangeTag, std::string>({2}, {"a", long_string});
+    auto arena = DataFrame<RangeTag, StringArena>({2}, {"a", long_string});
+
+    EXPECT_GT(strings.memory_usage().value_bytes, 2 * sizeof(std::string) + 100);
+    EXPECT_LT(arena.memory_usage().value_bytes, strings.memory_usage().value_bytes);
+}
+
 TEST(Concat, Interleaved_No_Overlap_Finish_With_df1) {
     auto df1 = DataFrame<int, float>({1, 4}, {10., 40.});
     auto df2 = DataFrame<int, float>({2, 3}, {20., 30.});
@@ -653,6 +862,1312 @@ TEST(Argsort, strings) {
     EXPECT_EQ(indices, (std::vector<size_t>{1, 2, 0}));
 }
 
+TEST(Argsort, categorical) {
+    std::vector<size_t> indices;
+    argsort(std::vector<Categorical<std::string>>{"Zaa", "Aaa", "Bbb", "Aaa"}, indices);
+    EXPECT_EQ(indices, (std::vector<size_t>{1, 3, 2, 0}));
+}
+
+struct Person {
+    std::string name;
+    int age;
+    float height;
+};
+
+void from_tab_separated_string(Person &p, const std::string_view &s) {
+    parse_tab_separated_string(s, p.name, p.age, p.height);
+}
+
+// Write a tsv file of Persons with a header line. Person i is named "person<i>".
+std::string write_people_tsv(const std::string &basename, int num_people, bool final_newline = true) {
+    auto filename = testing::TempDir() + basename;
+    std::ofstream f(filename);
+    f << "name\tage\theight";
+    for (int i = 0; i < num_people; ++i)
+        f << "\nperson" << i << '\t' << i % 90 << '\t' << 1.5 + i % 7 * .1;
+    if (final_newline)
+        f << '\n';
+    return filename;
+}
+
+TEST(ReadTsv, read_tsv) {
+    auto df = read_tsv<Person>(write_people_tsv("people.tsv", 3));
+
+    ASSERT_EQ(df.size(), 3);
+    EXPECT_EQ(df[2].v.name, "person2");
+    EXPECT_EQ(df[2].v.age, 2);
+    EXPECT_FLOAT_EQ(df[2].v.height, 1.7);
+}
+
+TEST(ReadTsv, columns) {
+    auto filename = write_people_tsv("people_columns.tsv", 10);
+    auto expected = read_tsv<Person>(filename);
+
+    for (size_t num_threads : {1, 3}) {
+        auto [heights, names, ages] =
+            read_tsv_columns<float, std::string_view, int>(filename, {2, 0, 1}, 1, num_threads);
+        static_assert(std::is_same_v<decltype(names), DataFrame<RangeTag, StringArena>>);
+
+        // The dataframes share their tags.
+        EXPECT_EQ(heights.tags, ages.tags);
+        EXPECT_EQ(names.tags, ages.tags);
+        ASSERT_EQ(ages.size(), 10);
+        for (size_t i = 0; i < expected.size(); ++i) {
+            EXPECT_EQ(names[i].v, expected[i].v.name);
+            EXPECT_EQ(ages[i].v, expected[i].v.age);
+            EXPECT_EQ(heights[i].v, expected[i].v.height);
+        }
+    }
+}
+
+TEST(ReadTsv, columns_missing_fields) {
+    auto filename = testing::TempDir() + "ragged.tsv";
+    std::ofstream(filename) << "a\tb\tc\n1\t2\t3\textra\n4\n\n5\t6";
+
+    auto [a, b] = read_tsv_columns<int, std::string>(filename, {0, 1});
+    ASSERT_EQ(a.size(), 4);
+    EXPECT_EQ(*a.values, (std::vector<int>{1, 4, 0, 5}));
+    EXPECT_EQ(*b.values, (std::vector<std::string>{"2", "", "", "6"}));
+
+    EXPECT_THROW(read_tsv_columns<>(filename, {}), std::invalid_argument);
+}
+
+TEST(ReadTsv, parallel_matches_read_tsv) {
+    auto filename = write_people_tsv("people_parallel.tsv", 1000);
+    auto expected = read_tsv<Person>(filename);
+
+    for (size_t num_threads : {1, 3, 8}) {
+        auto df = read_tsv_parallel<Person>(filename, 1, num_threads);
+        ASSERT_EQ(df.size(), expected.size());
+        for (size_t i = 0; i < df.size(); ++i) {
+            EXPECT_EQ(df[i].v.name, expected[i].v.name);
+            EXPECT_EQ(df[i].v.age, expected[i].v.age);
+            EXPECT_EQ(df[i].v.height, expected[i].v.height);
+        }
+    }
+}
+
+TEST(ReadTsv, parallel_no_final_newline) {
+    auto df = read_tsv_parallel<Person>(write_people_tsv("people_no_newline.tsv", 10, false), 1, 4);
+
+    ASSERT_EQ(df.size(), 10);
+    EXPECT_EQ(df[9].v.name, "person9");
+    EXPECT_EQ(df[9].v.age, 9);
+}
+
+TEST(ReadTsv, parallel_header_only) {
+    auto df = read_tsv_parallel<Person>(write_people_tsv("people_empty.tsv", 0), 1, 4);
+
+    EXPECT_EQ(df.size(), 0);
+}
+
+TEST(ReadTsv, from_string_numbers) {
+    int i = -1;
+    float f = -1;
+    size_t u = 1;
+    double d = -1;
+
+    from_string(i, std::string_view("42\tnext", 2));
+    from_string(f, "2.5");
+    from_string(u, "12345678901");
+    from_string(d, "1e-3");
+    EXPECT_EQ(i, 42);
+    EXPECT_EQ(f, 2.5);
+    EXPECT_EQ(u, 12345678901ull);
+    EXPECT_EQ(d, 1e-3);
+
+    from_string(i, "");
+    EXPECT_EQ(i, 0);
+}
+
+TEST(ReadTsv, find_delimiters) {
+    std::string line;
+    std::vector<size_t> expected;
+    for (int i = 0; i < 20; ++i) {
+        line += "field" + std::to_string(i);
+        expected.push_back(line.size());
+        line += i < 19 ? '\t' : '\n';
+    }
+
+    size_t delimiters[32];
+    ASSERT_EQ(find_delimiters(line, delimiters, 32), 20);
+    EXPECT_EQ(std::vector<size_t>(delimiters, delimiters + 20), expected);
+
+    ASSERT_EQ(find_delimiters(line, delimiters, 3), 3);
+    EXPECT_EQ(std::vector<size_t>(delimiters, delimiters + 3),
+              std::vector<size_t>(expected.begin(), expected.begin() + 3));
+}
+
+TEST(ReadTsv, parse_tab_separated_string) {
+    Person p{"nobody", -1, -1};
+    parse_tab_separated_string("ali\t33\t1.75\n", p.name, p.age, p.height);
+    EXPECT_EQ(p.name, "ali");
+    EXPECT_EQ(p.age, 33);
+    EXPECT_EQ(p.height, 1.75f);
+
+    // Missing fields leave their values as they were.
+    Person q{"nobody", -1, -1};
+    parse_tab_separated_string("john\t40\n", q.name, q.age, q.height);
+    EXPECT_EQ(q.name, "john");
+    EXPECT_EQ(q.age, 40);
+    EXPECT_EQ(q.height, -1);
+}
+
+TEST(ReadTsv, long_lines) {
+    auto filename = testing::TempDir() + "long_lines.tsv";
+    std::string long_name(100000, 'x');
+    std::ofstream(filename) << "name\tage\theight\n" << long_name << "\t3\t1.5\nali\t4\t1.25\n";
+
+    auto df = read_tsv<Person>(filename);
+
+    ASSERT_EQ(df.size(), 2);
+    EXPECT_EQ(df[0].v.name, long_name);
+    EXPECT_EQ(df[1].v.height, 1.25f);
+}
+
+TEST(Binary, round_trip_zero_copy) {
+    auto filename = testing::TempDir() + "floats.df";
+    auto df = DataFrame<int, float>({1, 2, 2, 3}, {10., 20., 100., 30.});
+    write_binary(df, filename);
+
+    auto loaded = read_binary<int, float>(filename);
+    static_assert(std::is_same_v<decltype(loaded), DataFrame<Mapped<int>, Mapped<float>>>);
+    ASSERT_EQ(loaded.size(), 4);
+    EXPECT_EQ(std::vector<int>(loaded.tags->begin(), loaded.tags->end()), *df.tags);
+    EXPECT_EQ(std::vector<float>(loaded.values->begin(), loaded.values->end()), *df.values);
+
+    // The values point into the mapping of the file, at a 64-byte aligned offset.
+    auto file = loaded.values->file;
+    EXPECT_GE((const char *)loaded.values->entries, file->data);
+    EXPECT_LT((const char *)loaded.values->entries, file->data + file->size);
+    EXPECT_EQ(uintptr_t(loaded.values->entries) % 64, 0);
+
+    auto g = *loaded.reduce_sum();
+    EXPECT_EQ(*g.tags, (std::vector<int>{1, 2, 3}));
+    EXPECT_EQ(*g.values, (std::vector<float>{10., 120., 30.}));
+}
+
+TEST(Binary, round_trip_strings) {
+    auto filename = testing::TempDir() + "strings.df";
+    write_binary(DataFrame<RangeTag, std::string>({3}, {"ali", "", std::string(1000, 'x')}), filename);
+
+    auto loaded = read_binary<RangeTag, std::string>(filename);
+    static_assert(std::is_same_v<decltype(loaded), DataFrame<RangeTag, StringArena>>);
+    ASSERT_EQ(loaded.size(), 3);
+    EXPECT_EQ(loaded[0].v, "ali");
+    EXPECT_EQ(loaded[1].v, "");
+    EXPECT_EQ(loaded[2].v, std::string(1000, 'x'));
+
+    // Arenas write the same format.
+    write_binary(loaded, filename);
+    auto reloaded = read_binary<RangeTag, StringArena>(filename);
+    EXPECT_EQ(reloaded[2].v, std::string(1000, 'x'));
+}
+
+TEST(Binary, detects_corruption) {
+    auto filename = testing::TempDir() + "corrupt.df";
+    write_binary(DataFrame<RangeTag, double>({100}, std::vector<double>(100, 1.)), filename);
+    EXPECT_THROW((read_binary<RangeTag, float>(filename)), std::runtime_error);
+
+    {
+        std::fstream f(filename, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(-10, std::ios::end);
+        f.put('!');
+    }
+    EXPECT_THROW((read_binary<RangeTag, double>(filename)), std::runtime_error);
+    EXPECT_NO_THROW((read_binary<RangeTag, double>(filename, false)));
+}
+
+TEST(Binary, checks_string_offsets_without_checksums) {
+    auto filename = testing::TempDir() + "corrupt_strings.df";
+    write_binary(DataFrame<RangeTag, std::string>({3}, {"ali", "", "bob"}), filename);
+
+    // Point the first string past the end of the column.
+    std::string bytes = (std::stringstream() << std::ifstream(filename, std::ios::binary).rdbuf()).str();
+    uint64_t offsets[] = {0, 3, 3, 6};
+    size_t at = bytes.find(std::string_view(reinterpret_cast<const char *>(offsets), sizeof(offsets)));
+    ASSERT_NE(at, std::string::npos);
+    offsets[1] = 1000;
+    bytes.replace(at, sizeof(offsets), reinterpret_cast<const char *>(offsets), sizeof(offsets));
+    std::ofstream(filename, std::ios::binary) << bytes;
+
+    EXPECT_THROW((read_binary<RangeTag, std::string>(filename, false)), std::runtime_error);
+}
+
+TEST(Binary, checksum_is_incremental) {
+    std::string data(1000, 'a');
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] += i % 26;
+
+    Checksum c;
+    c.update(data.data(), 5).update(data.data() + 5, 40).update(data.data() + 45, 955);
+    EXPECT_EQ(c.finish(), checksum(data.data(), data.size()));
+    EXPECT_NE(checksum(data.data(), 999), checksum(data.data(), data.size()));
+}
+
+TEST(Arrow, round_trip_zero_copy) {
+    auto filename = testing::TempDir() + "floats.arrow";
+    auto df = DataFrame<int, float>({1, 2, 2, 3}, {10., 20., 100., 30.});
+    write_arrow(df, filename);
+
+    auto loaded = read_arrow<int, float>(filename);
+    static_assert(std::is_same_v<decltype(loaded), DataFrame<Mapped<int>, Mapped<float>>>);
+    ASSERT_EQ(loaded.size(), 4);
+    EXPECT_EQ(std::vector<int>(loaded.tags->begin(), loaded.tags->end()), *df.tags);
+    EXPECT_EQ(std::vector<float>(loaded.values->begin(), loaded.values->end()), *df.values);
+
+    // The values point into the mapping of the file.
+    auto file = loaded.values->file;
+    ASSERT_TRUE(file);
+    EXPECT_GE((const char *)loaded.values->entries, file->data);
+    EXPECT_LT((const char *)loaded.values->entries, file->data + file->size);
+}
+
+TEST(Arrow, strings_in_several_batches) {
+    auto filename = testing::TempDir() + "strings.arrow";
+    write_arrow(DataFrame<StringArena, int64_t>({"ali", "", "bob", std::string(1000, 'x'), "eve"}, {1, 2, 3, 4, 5}),
+                filename, 2);
+
+    auto loaded = read_arrow<std::string, int64_t>(filename);
+    static_assert(std::is_same_v<decltype(loaded), DataFrame<StringArena, Mapped<int64_t>>>);
+    ASSERT_EQ(loaded.size(), 5);
+    EXPECT_EQ(loaded[0].t, "ali");
+    EXPECT_EQ(loaded[1].t, "");
+    EXPECT_EQ(loaded[3].t, std::string(1000, 'x'));
+    EXPECT_EQ(loaded[4].t, "eve");
+
+    // Values spread over several batches are copied.
+    EXPECT_FALSE(loaded.values->file);
+    EXPECT_EQ(std::vector<int64_t>(loaded.values->begin(), loaded.values->end()),
+              (std::vector<int64_t>{1, 2, 3, 4, 5}));
+}
+
+TEST(Arrow, range_tags_and_column_names) {
+    auto filename = testing::TempDir() + "range.arrow";
+    write_arrow(DataFrame<RangeTag, double>({3}, {.5, .25, .125}), filename);
+
+    auto loaded = read_arrow<RangeTag, double>(filename);
+    ASSERT_EQ(loaded.size(), 3);
+    EXPECT_EQ(loaded[2].t, 2);
+    EXPECT_EQ(loaded[2].v, .125);
+
+    // The file has no column named "tag", but its values can be read as tags.
+    auto retagged = read_arrow<double, double>(filename, "value", "value");
+    EXPECT_EQ(retagged[1].t, .25);
+    EXPECT_THROW((read_arrow<int, double>(filename)), std::runtime_error);
+}
+
+// testdata/pyarrow_strings.arrow was written by pyarrow 26 with
+//
+//   schema = pa.schema([("tag", pa.utf8()), ("value", pa.int64()), ("score", pa.float64())])
+//   with pa.ipc.new_file("pyarrow_strings.arrow", schema) as w:
+//       w.write_batch(pa.record_batch([["", "ali", "bob"], [1, 2, 3], [.5, .25, .125]], schema=schema))
+//       w.write_batch(pa.record_batch([["carl", "x" * 300], [4, 5], [1., 2.]], schema=schema))
+//       w.write_batch(pa.record_batch([["zoe"], [6], [3.]], schema=schema))
+TEST(Arrow, reads_a_file_written_by_pyarrow) {
+    std::string dir = std::filesystem::path(__FILE__).parent_path();
+    auto filename = (dir.empty() ? "" : dir + "/") + "testdata/pyarrow_strings.arrow";
+
+    auto df = read_arrow<std::string, int64_t>(filename);
+    ASSERT_EQ(df.size(), 6);
+    std::vector<std::string> tags;
+    for (size_t i = 0; i < df.size(); ++i)
+        tags.emplace_back(df[i].t);
+    EXPECT_EQ(tags, (std::vector<std::string>{"", "ali", "bob", "carl", std::string(300, 'x'), "zoe"}));
+    EXPECT_EQ(std::vector<int64_t>(df.values->begin(), df.values->end()), (std::vector<int64_t>{1, 2, 3, 4, 5, 6}));
+
+    auto scores = read_arrow<std::string, double>(filename, "tag", "score");
+    EXPECT_EQ(std::vector<double>(scores.values->begin(), scores.values->end()),
+              (std::vector<double>{.5, .25, .125, 1., 2., 3.}));
+}
+
+TEST(Arrow, rejects_bad_files) {
+    auto filename = testing::TempDir() + "bad.arrow";
+    write_arrow(DataFrame<RangeTag, double>({100}, std::vector<double>(100, 1.)), filename);
+    EXPECT_THROW((read_arrow<RangeTag, float>(filename)), std::runtime_error);
+    EXPECT_THROW((read_arrow<RangeTag, std::string>(filename)), std::runtime_error);
+
+    write_binary(DataFrame<RangeTag, double>({100}, std::vector<double>(100, 1.)), filename);
+    EXPECT_THROW((read_arrow<RangeTag, double>(filename)), std::runtime_error);
+}
+
+TEST(Compressed, round_trip) {
+    auto filename = testing::TempDir() + "ints.dfz";
+    std::vector<int> tags(10000);
+    std::vector<double> values(tags.size());
+    for (size_t i = 0; i < tags.size(); ++i) {
+        tags[i] = i / 3;
+        values[i] = i % 17 * .5;
+    }
+    auto df = DataFrame<int, double>(tags, values);
+
+    std::vector<Compression> compressions = {Compression::None};
+#ifdef DATAFRAME_WITH_LZ4
+    compressions.push_back(Compression::LZ4);
+#endif
+#ifdef DATAFRAME_WITH_ZSTD
+    compressions.push_back(Compression::Zstd);
+#endif
+    for (Compression compression : compressions) {
+        // Small chunks so each array is cut into many chunks.
+        write_compressed(df, filename, compression, 1, 1000, 3);
+        auto loaded = read_compressed<int, double>(filename, 4);
+        static_assert(std::is_same_v<decltype(loaded), DataFrame<int, double>>);
+        EXPECT_EQ(*loaded.tags, tags);
+        EXPECT_EQ(*loaded.values, values);
+    }
+}
+
+TEST(Compressed, strings_and_range_tags) {
+    auto filename = testing::TempDir() + "strings.dfz";
+    std::vector<std::string> values = {"ali", "", std::string(5000, 'x'), "bob"};
+    write_compressed(DataFrame<RangeTag, std::string>({values.size()}, values), filename, Compression::None, 1, 64);
+
+    auto loaded = read_compressed<RangeTag, std::string>(filename);
+    static_assert(std::is_same_v<decltype(loaded), DataFrame<RangeTag, StringArena>>);
+    ASSERT_EQ(loaded.size(), 4);
+    for (size_t i = 0; i < values.size(); ++i)
+        EXPECT_EQ(loaded[i].v, values[i]);
+
+    // Arenas write the same format.
+    write_compressed(loaded, filename, Compression::None);
+    EXPECT_EQ((read_compressed<RangeTag, StringArena>(filename)[2].v), values[2]);
+}
+
+#ifdef DATAFRAME_WITH_LZ4
+TEST(Compressed, compresses) {
+    auto filename = testing::TempDir() + "zeros.dfz";
+    auto df = DataFrame<RangeTag, int64_t>({1000000}, std::vector<int64_t>(1000000, 7));
+    write_compressed(df, filename, Compression::LZ4);
+
+    EXPECT_LT(MappedFile(filename).size, df.size() * sizeof(int64_t) / 50);
+    EXPECT_EQ((read_compressed<RangeTag, int64_t>(filename)[999999].v), 7);
+}
+#endif
+
+TEST(Compressed, detects_corruption) {
+    auto filename = testing::TempDir() + "corrupt.dfz";
+    write_compressed(DataFrame<RangeTag, double>({100}, std::vector<double>(100, 1.)), filename, Compression::None);
+    EXPECT_THROW((read_compressed<RangeTag, float>(filename)), std::runtime_error);
+    EXPECT_THROW((read_binary<RangeTag, double>(filename)), std::runtime_error);
+
+    {
+        std::fstream f(filename, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(sizeof(CompressedHeader) + 10);
+        f.put('!');
+    }
+    EXPECT_THROW((read_compressed<RangeTag, double>(filename)), std::runtime_error);
+}
+
+TEST(Prefetch, reads_whole_file) {
+    auto filename = testing::TempDir() + "prefetch.txt";
+    std::string contents;
+    for (int i = 0; i < 10000; ++i)
+        contents += std::to_string(i) + (i % 7 ? "\t" : "\n");
+    std::ofstream(filename) << contents;
+
+    for (bool use_io_uring : {false, true})
+        for (size_t queue_depth : {1, 2, 8}) {
+            PrefetchingReader reader(filename, 1000, queue_depth, use_io_uring);
+            std::string read;
+            for (auto block = reader.next(); !block.empty(); block = reader.next()) {
+                EXPECT_LE(block.size(), 1000);
+                read += block;
+            }
+            EXPECT_EQ(read, contents);
+        }
+}
+
+TEST(Prefetch, stop_early) {
+    auto filename = testing::TempDir() + "prefetch_stop.txt";
+    std::ofstream(filename) << std::string(100000, 'x');
+
+    // Destroying a reader waits for the reads it has in flight.
+    for (bool use_io_uring : {false, true}) {
+        PrefetchingReader reader(filename, 1000, 4, use_io_uring);
+        EXPECT_EQ(reader.next().size(), 1000);
+    }
+}
+
+TEST(Prefetch, lines_span_blocks) {
+    auto filename = testing::TempDir() + "prefetch_lines.txt";
+    std::ofstream(filename) << "short\n" << std::string(50, 'x') << "\n\nlast";
+
+    PrefetchingLineReader reader(filename, 8, 2);
+    EXPECT_EQ(reader.next_line(), "short\n");
+    EXPECT_EQ(reader.next_line(), std::string(50, 'x') + "\n");
+    EXPECT_EQ(reader.next_line(), "\n");
+    EXPECT_EQ(reader.next_line(), "last");
+    EXPECT_EQ(reader.next_line(), "");
+}
+
+TEST(Prefetch, empty_and_missing_files) {
+    auto filename = testing::TempDir() + "prefetch_empty.txt";
+    std::ofstream{filename};
+    PrefetchingReader reader(filename);
+    EXPECT_TRUE(reader.next().empty());
+
+    EXPECT_THROW(PrefetchingReader(testing::TempDir() + "no_such_file"), std::system_error);
+}
+
+TEST(Prefetch, read_tsv_with_small_buffers) {
+    auto filename = write_people_tsv("people_prefetch.tsv", 1000);
+    auto expected = read_tsv_parallel<Person>(filename);
+
+    std::vector<Person> people;
+    read_tsv(people, filename, 1, 64, 3);
+    ASSERT_EQ(people.size(), expected.size());
+    for (size_t i = 0; i < people.size(); ++i)
+        EXPECT_EQ(people[i].name, expected[i].v.name);
+}
+
+// The rows of a dataframe, in order.
+template <typename DF>
+auto rows(const DF &df) {
+    std::vector<std::pair<typename DF::Tag, typename DF::Value>> result;
+    for (size_t i = 0; i < df.size(); ++i)
+        result.push_back({df[i].t, df[i].v});
+    return result;
+}
+
+TEST(Appendable, merged_view_is_sorted_and_stable) {
+    for (bool background : {false, true}) {
+        AppendableDataFrame<int, int> frame(7, background);
+        std::vector<std::pair<int, int>> expected;
+        for (int i = 0; i < 1000; ++i) {
+            int tag = (i * 7919) % 101;
+            frame.append(tag, i);
+            expected.push_back({tag, i});
+        }
+        // Rows with equal tags stay in the order they were appended.
+        std::stable_sort(expected.begin(), expected.end(),
+                         [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        EXPECT_EQ(frame.size(), 1000);
+        EXPECT_EQ(rows(frame.materialize()), expected);
+
+        // Compaction keeps the number of runs logarithmic.
+        frame.wait_for_compaction();
+        EXPECT_GT(frame.num_compactions(), 0);
+        EXPECT_LE(frame.num_runs(), 10);
+        EXPECT_EQ(rows(frame.materialize()), expected);
+
+        frame.compact();
+        EXPECT_EQ(frame.num_runs(), 1);
+        EXPECT_EQ(rows(frame.materialize()), expected);
+    }
+}
+
+TEST(Appendable, views_are_snapshots) {
+    AppendableDataFrame<int, float> frame(4);
+    frame.append(3, 30.);
+    frame.append(1, 10.);
+    auto view = frame.to_expr();
+
+    for (int i = 0; i < 100; ++i)
+        frame.append(2, 1.);
+    frame.compact();
+
+    auto df = view.materialize();
+    EXPECT_EQ(*df.tags, (std::vector<int>{1, 3}));
+    EXPECT_EQ(frame.size(), 102);
+    EXPECT_EQ(frame.to_expr().reduce_sum().materialize()[1].v, 100.);
+}
+
+TEST(Appendable, collate) {
+    AppendableDataFrame<int, float> frame(2, false);
+    for (int tag : {5, 1, 4, 2, 3, 9, 7})
+        frame.append(tag, tag * 10.);
+
+    auto lookup = DataFrame<int, float>({2, 3, 6, 7}, {1., 2., 3., 4.});
+    auto df = frame.to_expr().collate(lookup, [](float v, float w) { return v + w; }).materialize();
+
+    EXPECT_EQ(*df.tags, (std::vector<int>{2, 3, 7}));
+    EXPECT_EQ(*df.values, (std::vector<float>{21., 32., 74.}));
+}
+
+TEST(Executor, parallel_for_each_index) {
+    ThreadPool pool(4);
+    SerialExecutor serial;
+    for (Executor *executor : {(Executor *)&pool, (Executor *)&serial}) {
+        std::vector<std::atomic<int>> counts(1000);
+        parallel_for_each_index(*executor, counts.size(), 8, [&](size_t i) { counts[i]++; });
+        for (auto &count : counts)
+            EXPECT_EQ(count, 1);
+    }
+}
+
+TEST(Executor, nested_loops_dont_deadlock) {
+    ThreadPool pool(2);
+    std::atomic<int> total = 0;
+    parallel_for_each_index(pool, 10, 10, [&](size_t) {
+        parallel_for_each_index(pool, 10, 10, [&](size_t) { total++; });
+    });
+    EXPECT_EQ(total, 100);
+}
+
+TEST(Executor, rethrows) {
+    ThreadPool pool(3);
+    std::atomic<int> calls = 0;
+    EXPECT_THROW(parallel_for_each_index(pool, 100, 3,
+                                         [&](size_t i) {
+                                             calls++;
+                                             if (i == 5)
+                                                 throw std::runtime_error("oops");
+                                         }),
+                 std::runtime_error);
+    EXPECT_LE(calls, 100);
+}
+
+TEST(Executor, idle_workers_steal) {
+    // A task queues three more on its own worker's deque and waits for them
+    // all to start, which only happens if the other workers steal them.
+    ThreadPool pool(4);
+    std::latch started(4), finished(1);
+    pool.submit([&] {
+        for (int k = 0; k < 3; ++k)
+            pool.submit([&] { started.arrive_and_wait(); });
+        started.arrive_and_wait();
+        finished.count_down();
+    });
+    finished.wait();
+}
+
+TEST(Executor, affinity) {
+    ThreadPool pool(2, {0});
+    std::atomic<int> cpu = -1;
+    std::latch done(1);
+    pool.submit([&] {
+        cpu = sched_getcpu();
+        done.count_down();
+    });
+    done.wait();
+    EXPECT_EQ(cpu, 0);
+}
+
+#ifdef DATAFRAME_WITH_EXECUTION_POLICIES
+TEST(Executor, execution_policies) {
+    EXPECT_EQ(executor_for(std::execution::seq).concurrency(), 1);
+    EXPECT_EQ(&executor_for(std::execution::par), &default_executor());
+
+    ThreadPool pool(3);
+    set_default_executor(&pool);
+    EXPECT_EQ(&executor_for(std::execution::par_unseq), &pool);
+
+    std::vector<int> v(100);
+    parallel_for_each_index(std::execution::par, v.size(), [&](size_t i) { v[i] = i; });
+    set_default_executor(nullptr);
+    EXPECT_EQ(v[99], 99);
+
+    auto filename = write_people_tsv("people_executor.tsv", 500);
+    set_default_executor(&pool);
+    auto df = read_tsv_parallel<Person>(filename, 1, 3);
+    set_default_executor(nullptr);
+    EXPECT_EQ(df.size(), 500);
+}
+#endif
+
+TEST(Partitioned, streams_in_tag_order) {
+    auto df = DataFrame<int, float>({1, 2, 2, 2, 3, 5, 8, 8, 9}, {1., 2., 3., 4., 5., 6., 7., 8., 9.});
+    auto parts = partition_by_tag(df, 4);
+    EXPECT_EQ(parts.size(), df.size());
+    EXPECT_LE(parts.num_partitions(), 4);
+    for (size_t p = 1; p < parts.num_partitions(); ++p)
+        EXPECT_LT(parts.last_tag(p - 1), parts.first_tag(p));
+
+    auto m = parts.materialize();
+    EXPECT_EQ(*m.tags, *df.tags);
+    EXPECT_EQ(*m.values, *df.values);
+
+    EXPECT_THROW((PartitionedDataFrame<int, float>({DataFrame<int, float>({1, 3}, {0., 0.}),
+                                                    DataFrame<int, float>({3, 4}, {0., 0.})})),
+                 std::runtime_error);
+}
+
+TEST(Partitioned, lookups_prune_to_one_partition) {
+    auto parts = PartitionedDataFrame<int, float>({DataFrame<int, float>({1, 3}, {10., 30.}),
+                                                   DataFrame<int, float>({5, 7}, {50., 70.}),
+                                                   DataFrame<int, float>({9}, {90.})});
+    EXPECT_EQ(parts.partition_of(3), 0);
+    EXPECT_EQ(parts.partition_of(4), 3);
+    EXPECT_EQ(parts.partition_of(7), 1);
+    EXPECT_EQ(parts.partition_of(10), 3);
+    EXPECT_EQ(parts.find(7), 70.);
+    EXPECT_EQ(parts.find(6), std::nullopt);
+
+    // Joining against the streamed partitions uses the same pruning.
+    auto lookup = DataFrame<int, float>({3, 4, 9}, {1., 1., 1.});
+    auto joined = lookup.collate(parts, [](float a, float b) { return a + b; }).materialize();
+    EXPECT_EQ(*joined.tags, (std::vector<int>{3, 9}));
+    EXPECT_EQ(*joined.values, (std::vector<float>{31., 91.}));
+}
+
+TEST(Partitioned, parallel_operations_match_serial) {
+    ThreadPool pool(4);
+    set_default_executor(&pool);
+
+    DataFrame<int, float> df;
+    for (int i = 0; i < 10000; ++i) {
+        df.tags->push_back(i / 3);
+        df.values->push_back(i % 7);
+    }
+    auto parts = partition_by_tag(df, 8);
+
+    auto sums = parts.reduce_sum().materialize();
+    auto expected_sums = df.reduce_sum().materialize();
+    EXPECT_EQ(*sums.tags, *expected_sums.tags);
+    EXPECT_EQ(*sums.values, *expected_sums.values);
+
+    auto squares = parts.apply([](float v) { return v * v; }).materialize();
+    EXPECT_EQ(*squares.values, *df.apply([](float v) { return v * v; }).materialize().values);
+
+    // Collating against differently partitioned dataframes, and a
+    // materialized one, splits them like parts.
+    DataFrame<int, float> other;
+    for (int t = 0; t < 4000; t += 5) {
+        other.tags->push_back(t);
+        other.values->push_back(t);
+    }
+    auto op = [](float a, float b) { return a * b; };
+    auto expected = sums.collate(other, op).materialize();
+    for (size_t n : {1, 3, 8}) {
+        auto joined = parts.reduce_sum().collate(partition_by_tag(other, n), op).materialize();
+        EXPECT_EQ(*joined.tags, *expected.tags);
+        EXPECT_EQ(*joined.values, *expected.values);
+    }
+    auto joined = parts.reduce_sum().collate(other, op);
+    EXPECT_EQ(joined.num_partitions(), parts.num_partitions());
+    EXPECT_EQ(*joined.materialize().values, *expected.values);
+
+    set_default_executor(nullptr);
+}
+
+TEST(Partitioned, forwards_dataframe_operations) {
+    ThreadPool pool(4);
+    set_default_executor(&pool);
+
+    DataFrame<int, float> df;
+    for (int i = 0; i < 1000; ++i) {
+        df.tags->push_back(i / 3);
+        df.values->push_back(i % 7);
+    }
+    auto parts = partition_by_tag(df, 4);
+
+    auto expect_same = [](auto a, auto b) {
+        auto ma = ::to_dataframe(a), mb = ::to_dataframe(b);
+        EXPECT_EQ(*ma.tags, *mb.tags);
+        EXPECT_EQ(*ma.values, *mb.values);
+    };
+    expect_same(parts.reduce_max(), df.reduce_max());
+    expect_same(parts.reduce_var(), df.reduce_var());
+    expect_same(parts.reduce_std(), df.reduce_std());
+    expect_same(parts([](float v) { return v + 1; }), df([](float v) { return v + 1; }));
+    expect_same(parts.count_values(), df.count_values());
+    expect_same(*parts, df);
+    expect_same(parts.materialize_as<int, float>(), df);
+    auto run_length = parts.materialize_run_length();
+    EXPECT_EQ(run_length.tags->runs.size(), 334);
+    EXPECT_EQ(*run_length.values, *df.values);
+
+    // Retagging and concatenating move entries across partitions.
+    auto by_value = [](int, float v) { return int(v); };
+    expect_same(parts.retag(by_value), df.retag(by_value));
+    auto value_tags = df.apply([](float v) { return int(v); }).materialize();
+    expect_same(parts.retag(partition_by_tag(value_tags, 3)), df.retag(value_tags));
+    expect_same(parts.concatenate(partition_by_tag(df, 2)), df.concatenate(df));
+    expect_same(parts.concatenate_parallel(partition_by_tag(df, 2)), df.concatenate(df));
+    expect_same(parts.pipeline(), df);
+
+    // Joins with expressions, and indexing.
+    auto op = [](float a, float b) { return a - b; };
+    auto doubled = df.apply([](float v) { return 2 * v; });
+    expect_same(parts.collate(doubled, op), df.collate(doubled, op));
+    expect_same(parts.collate_parallel(doubled, op), df.collate(doubled, op));
+    DataFrame<int, int> index({5, 100, 250, 400}, {0, 0, 0, 0});
+    expect_same(parts[index], df[index]);
+    for (size_t i : {0, 1, 499, 999}) {
+        EXPECT_EQ(parts[i].t, df[i].t);
+        EXPECT_EQ(parts[i].v, df[i].v);
+    }
+
+    set_default_executor(nullptr);
+}
+
+TEST(ConcurrentBuilder, range_tags) {
+    ConcurrentBuilder<RangeTag, int> builder(10);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t] {
+            auto writer = builder.writer();
+            for (int i = 0; i < 1001; ++i)
+                writer.push_back(t * 10000 + i);
+        });
+    for (auto &thread : threads)
+        thread.join();
+
+    auto df = builder.finish();
+    EXPECT_EQ(df.size(), 4004);
+    std::vector<int> values = *df.values;
+    std::sort(values.begin(), values.end());
+    for (int t = 0; t < 4; ++t)
+        for (int i = 0; i < 1001; ++i)
+            EXPECT_EQ(values[t * 1001 + i], t * 10000 + i);
+
+    // Each thread's rows keep their order.
+    for (size_t i = 1; i < df.size(); ++i) {
+        int a = (*df.values)[i - 1], b = (*df.values)[i];
+        EXPECT_TRUE(a / 10000 != b / 10000 || a < b);
+    }
+
+    EXPECT_EQ(builder.finish().size(), 0);
+}
+
+TEST(ConcurrentBuilder, sorted) {
+    ThreadPool pool(4);
+    set_default_executor(&pool);
+
+    ConcurrentBuilder<int, std::string> builder(37);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t] {
+            auto writer = builder.writer();
+            for (int i = 0; i < 500; ++i)
+                writer.push_back((i * 7919 + t) % 97, std::to_string(t));
+        });
+    for (auto &thread : threads)
+        thread.join();
+
+    auto df = builder.finish();
+    set_default_executor(nullptr);
+
+    EXPECT_EQ(df.size(), 2000);
+    EXPECT_TRUE(std::is_sorted(df.tags->begin(), df.tags->end()));
+    std::map<std::pair<int, std::string>, int> expected, got;
+    for (int t = 0; t < 4; ++t)
+        for (int i = 0; i < 500; ++i)
+            expected[{(i * 7919 + t) % 97, std::to_string(t)}]++;
+    for (size_t i = 0; i < df.size(); ++i)
+        got[{(*df.tags)[i], (*df.values)[i]}]++;
+    EXPECT_EQ(got, expected);
+}
+
+TEST(Pipeline, matches_serial) {
+    DataFrame<int, float> df;
+    for (int i = 0; i < 10000; ++i) {
+        df.tags->push_back(i);
+        df.values->push_back(i % 13);
+    }
+    auto square = [](float v) { return v * v; };
+    auto key = [](int t, float) { return t / 10; };
+
+    auto expected = df.apply(square).retag(key).reduce_sum().materialize();
+    for (size_t batch_size : {1, 7, 1024}) {
+        auto got = df.apply(square).pipeline(batch_size, 2).retag(key).pipeline(batch_size).reduce_sum().materialize();
+        EXPECT_EQ(*got.tags, *expected.tags);
+        EXPECT_EQ(*got.values, *expected.values);
+    }
+
+    auto empty = DataFrame<int, float>().apply(square).pipeline().materialize();
+    EXPECT_EQ(empty.size(), 0);
+}
+
+TEST(Pipeline, consumer_stops_early) {
+    // The intersection stops reading the pipelined stage long before it's
+    // done. Destroying the stage must stop its thread.
+    DataFrame<int, float> df;
+    for (int i = 0; i < 100000; ++i) {
+        df.tags->push_back(i);
+        df.values->push_back(i);
+    }
+    auto few = DataFrame<int, float>({3, 5}, {1., 1.});
+    auto joined = df.to_expr().pipeline(16, 2).collate(few, [](float a, float b) { return a + b; }).materialize();
+    EXPECT_EQ(*joined.values, (std::vector<float>{4., 6.}));
+}
+
+TEST(Pipeline, rethrows) {
+    auto df = DataFrame<int, float>({1, 2, 3}, {1., 2., 3.});
+    auto stage = df.apply([](float v) {
+                       if (v == 3.)
+                           throw std::runtime_error("bad value");
+                       return v;
+                   })
+                     .pipeline(1);
+    EXPECT_THROW(stage.materialize(), std::runtime_error);
+}
+
+Generator<std::pair<int, float>> squares(int n) {
+    for (int i = 0; i < n; ++i)
+        co_yield {i, float(i * i)};
+}
+
+Sink<int, float> sum_values(float &sum, int &rows) {
+    while (auto row = co_await next_row) {
+        sum += row->second;
+        rows++;
+    }
+}
+
+TEST(Generator, source) {
+    auto df = from_generator([] { return squares(5); });
+    auto m = df.materialize();
+    EXPECT_EQ(*m.tags, (std::vector<int>{0, 1, 2, 3, 4}));
+    EXPECT_EQ(*m.values, (std::vector<float>{0., 1., 4., 9., 16.}));
+
+    // Copies made before evaluation evaluate independently, which retag relies on.
+    auto retagged = df.retag([](int t, float) { return t % 2; }).reduce_sum().materialize();
+    EXPECT_EQ(*retagged.values, (std::vector<float>{20., 10.}));
+
+    auto joined = df.collate(DataFrame<int, float>({1, 3, 7}, {1., 1., 1.}), [](float a, float b) { return a + b; });
+    EXPECT_EQ(*joined.materialize().values, (std::vector<float>{2., 10.}));
+}
+
+TEST(Generator, yields_by_reference) {
+    struct Counted {
+        int copies = 0;
+        Counted() = default;
+        Counted(const Counted &other) : copies(other.copies + 1) {}
+        Counted &operator=(const Counted &) = default;
+    };
+    auto generate = []() -> Generator<std::pair<int, Counted>> {
+        std::pair<int, Counted> row;
+        for (row.first = 0; row.first < 3; ++row.first)
+            co_yield row;
+    };
+    auto gen = generate();
+    int n = 0;
+    for (; gen.next(); ++n)
+        EXPECT_EQ(gen.value().second.copies, 0);
+    EXPECT_EQ(n, 3);
+}
+
+TEST(Generator, rethrows) {
+    auto df = from_generator([]() -> Generator<std::pair<int, float>> {
+        co_yield {1, 1.};
+        throw std::runtime_error("bad input");
+    });
+    EXPECT_THROW(df.materialize(), std::runtime_error);
+}
+
+TEST(Generator, sink) {
+    float sum = 0;
+    int rows = 0;
+    feed(DataFrame<int, float>({1, 2, 3}, {1., 2., 3.}).apply([](float v) { return 2 * v; }), sum_values(sum, rows));
+    EXPECT_EQ(sum, 12.);
+    EXPECT_EQ(rows, 3);
+
+    // A sink that returns early stops the feed.
+    auto first_two = [](std::vector<int> &tags) -> Sink<int, float> {
+        for (int k = 0; k < 2; ++k)
+            tags.push_back((co_await next_row)->first);
+    };
+    std::vector<int> tags;
+    feed(from_generator([] { return squares(1000000); }), first_two(tags));
+    EXPECT_EQ(tags, (std::vector<int>{0, 1}));
+}
+
+TEST(Pipeline, parallel_branches) {
+    DataFrame<int, float> df;
+    for (int i = 0; i < 20000; ++i) {
+        df.tags->push_back(i);
+        df.values->push_back(i % 11);
+    }
+    auto by_3 = [](int t, float) { return t / 3; };
+    auto by_5 = [](int t, float) { return t / 5; };
+    auto op = [](float a, float b) { return a - b; };
+
+    auto left = df.retag(by_3).reduce_sum();
+    auto right = df.retag(by_5).reduce_max();
+    auto expected = left.collate(right, op).materialize();
+    for (size_t batch_size : {1, 5, 1024}) {
+        auto got = left.collate_parallel(right, op, batch_size, 2).materialize();
+        EXPECT_EQ(*got.tags, *expected.tags);
+        EXPECT_EQ(*got.values, *expected.values);
+    }
+
+    // The left branch is missing most of the right branch's tags.
+    auto dense = df.retag([](int t, float) { return 3 * t; }).reduce_sum();
+    auto expected_sparse = dense.materialize().collate(df, op).materialize();
+    auto got_sparse = dense.collate_parallel(df.apply([](float v) { return v; }), op, 7).materialize();
+    EXPECT_EQ(got_sparse.size(), 6667);
+    EXPECT_EQ(*got_sparse.tags, *expected_sparse.tags);
+    EXPECT_EQ(*got_sparse.values, *expected_sparse.values);
+
+    auto merged = left.concatenate_parallel(right, 16).materialize();
+    auto expected_merged = left.concatenate(right).materialize();
+    EXPECT_EQ(*merged.tags, *expected_merged.tags);
+    EXPECT_EQ(*merged.values, *expected_merged.values);
+}
+
+TEST(SharedMemory, attach_from_another_process) {
+    std::string name = "/dataframe_test_" + std::to_string(getpid());
+    DataFrame<int, double> df;
+    for (int i = 0; i < 100000; ++i) {
+        df.tags->push_back(2 * i);
+        df.values->push_back(i * 0.5);
+    }
+
+    {
+        auto shared = share_dataframe(df, name);
+        EXPECT_EQ(*to_expr(shared).reduce_sum().materialize().values, *to_expr(df).reduce_sum().materialize().values);
+        EXPECT_THROW(share_dataframe(df, name), std::system_error);
+
+        pid_t child = fork();
+        if (child == 0) {
+            // The child attaches and checks the dataframe, then exits with a
+            // status that says whether it matched.
+            auto attached = attach_dataframe<int, double>(name, true);
+            bool ok = attached.size() == df.size();
+            for (size_t i = 0; ok && i < df.size(); ++i)
+                ok = attached[i].t == (*df.tags)[i] && attached[i].v == (*df.values)[i];
+            _exit(ok ? 0 : 1);
+        }
+        int status;
+        waitpid(child, &status, 0);
+        EXPECT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(WEXITSTATUS(status), 0);
+
+        // The child has detached, but this process still holds shared, so the
+        // object is still there.
+        EXPECT_EQ((attach_dataframe<int, double>(name).size()), df.size());
+
+        // The mapping is the shared object itself, not a copy.
+        EXPECT_EQ(storage_bytes(*shared.values), sizeof(*shared.values));
+    }
+
+    // The last dataframe attached to the object is gone, so it was removed.
+    EXPECT_THROW((attach_dataframe<int, double>(name)), std::system_error);
+    unlink_shared_dataframe(name);
+}
+
+TEST(SharedMemory, strings) {
+    std::string name = "/dataframe_test_strings_" + std::to_string(getpid());
+    auto df = DataFrame<int, std::string>({1, 2}, {"one", "two"});
+    auto shared = share_dataframe(df, name);
+    EXPECT_EQ(shared[1].v, "two");
+    auto attached = attach_dataframe<int, std::string>(name);
+    EXPECT_EQ(attached[0].v, "one");
+}
+
+TEST(SharedMemory, keeps_a_new_object_under_the_same_name) {
+    std::string name = "/dataframe_test_reshared_" + std::to_string(getpid());
+    auto df = DataFrame<int, int>({1, 2}, {10, 20});
+    {
+        std::optional<decltype(share_dataframe(df, name))> old_shared = share_dataframe(df, name);
+        unlink_shared_dataframe(name);
+        auto new_shared = share_dataframe(df, name);
+        old_shared.reset();
+        auto attached = attach_dataframe<int, int>(name);
+        EXPECT_EQ(attached[1].v, 20);
+    }
+    // The last dataframe attached to the new object removed it.
+    EXPECT_THROW((attach_dataframe<int, int>(name)), std::system_error);
+}
+
+TEST(Shuffle, group_by_matches_serial) {
+    DataFrame<int, double> df;
+    for (int i = 0; i < 20000; ++i) {
+        df.tags->push_back(i % 3 ? i / 5 : 4000 - i / 5);
+        df.values->push_back(i % 11);
+    }
+    std::vector<size_t> order;
+    argsort(*df.tags, order);
+    DataFrame<int, double> sorted;
+    for (size_t i : order) {
+        sorted.tags->push_back((*df.tags)[i]);
+        sorted.values->push_back((*df.values)[i]);
+    }
+    auto expected = sorted.reduce_sum().materialize();
+
+    // The input rows needn't be sorted, since each worker sorts what it
+    // receives.
+    auto sum = [](auto &part) { return part.reduce_sum(); };
+    for (size_t n : {1, 3, 4}) {
+        auto by_hash = shuffle(n, HashPartitioner(), sum, df);
+        EXPECT_EQ(*by_hash.tags, *expected.tags);
+        EXPECT_EQ(*by_hash.values, *expected.values);
+
+        auto by_range = shuffle(n, RangePartitioner<int>{{1000, 2000, 3000}}, sum, df);
+        EXPECT_EQ(*by_range.tags, *expected.tags);
+        EXPECT_EQ(*by_range.values, *expected.values);
+    }
+}
+
+TEST(Shuffle, join_matches_serial) {
+    DataFrame<int, float> left, right;
+    for (int i = 0; i < 5000; ++i) {
+        left.tags->push_back(i);
+        left.values->push_back(i * 0.5);
+    }
+    for (int i = 0; i < 9000; i += 3) {
+        right.tags->push_back(i);
+        right.values->push_back(i);
+    }
+    auto op = [](float a, float b) { return a + b; };
+    auto expected = left.collate(right, op).materialize();
+
+    // Each worker produces its own share of the right side rather than
+    // reading a slice of a dataframe.
+    auto right_slice = [](size_t w, size_t n) {
+        return from_generator([w, n]() -> Generator<std::pair<int, float>> {
+            for (int i = 3 * w; i < 9000; i += 3 * n)
+                co_yield {i, float(i)};
+        });
+    };
+    auto joined = shuffle(3, HashPartitioner(), [&](auto &l, auto &r) { return l.collate(r, op); }, left,
+                          right_slice);
+    EXPECT_EQ(*joined.tags, *expected.tags);
+    EXPECT_EQ(*joined.values, *expected.values);
+}
+
+TEST(Shuffle, string_keys) {
+    DataFrame<std::string, int> df;
+    for (int i = 0; i < 3000; ++i) {
+        df.tags->push_back("key" + std::to_string(i % 97));
+        df.values->push_back(i);
+    }
+    auto sorted = df.retag([](const std::string &t, int) { return t; }).materialize();
+    auto expected = sorted.reduce_sum().materialize();
+
+    auto sums = shuffle(3, HashPartitioner(), [](auto &part) { return part.reduce_sum(); }, df);
+    static_assert(std::is_same_v<decltype(sums), DataFrame<std::string, int>>);
+    EXPECT_EQ(*sums.tags, std::vector<std::string>(expected.tags->begin(), expected.tags->end()));
+    EXPECT_EQ(*sums.values, *expected.values);
+}
+
+TEST(Shuffle, after_the_thread_pool_ran) {
+    ThreadPool pool(4);
+    set_default_executor(&pool);
+    std::atomic<size_t> total = 0;
+    parallel_for_each_index(1000, 4, [&](size_t i) { total += i; });
+    EXPECT_EQ(total, 1000 * 999 / 2);
+
+    // The workers run the parallel loop without the pool's threads.
+    auto df = DataFrame<int, double>({1, 1, 2, 3, 3, 3}, {1., 2., 3., 4., 5., 6.});
+    auto sums = shuffle(
+        2, HashPartitioner(),
+        [](auto &part) {
+            std::vector<double> doubled(part.size());
+            parallel_for_each_index(part.size(), 4, [&](size_t i) { doubled[i] = 2 * (*part.values)[i]; });
+            return DataFrame<int, double>(*part.tags, doubled).reduce_sum();
+        },
+        df);
+    set_default_executor(nullptr);
+
+    EXPECT_EQ(*sums.tags, (std::vector<int>{1, 2, 3}));
+    EXPECT_EQ(*sums.values, (std::vector<double>{6., 6., 30.}));
+}
+
+TEST(Shuffle, worker_errors_propagate) {
+    auto df = DataFrame<int, float>({1, 2, 3, 4, 5, 6}, {1., 2., 3., 4., 5., 6.});
+    auto fail = [](auto &part) {
+        if (part.size() && (*part.tags)[0] == 3)
+            throw std::runtime_error("bad partition");
+        return part.reduce_sum();
+    };
+    try {
+        shuffle(3, RangePartitioner<int>{{3, 5}}, fail, df);
+        FAIL() << "expected the shuffle to throw";
+    } catch (const std::runtime_error &e) {
+        EXPECT_EQ(std::string(e.what()), "shuffle: worker 1: bad partition");
+    }
+
+    // Exceptions of any type stay in the worker that threw them.
+    pid_t pid = getpid();
+    auto throw_int = [](auto &part) {
+        if (part.size())
+            throw 42;
+        return part.reduce_sum();
+    };
+    try {
+        shuffle(3, RangePartitioner<int>{{3, 5}}, throw_int, df);
+        FAIL() << "expected the shuffle to throw";
+    } catch (const std::runtime_error &e) {
+        EXPECT_EQ(std::string(e.what()), "shuffle: worker 0: unknown exception");
+    }
+    ASSERT_EQ(getpid(), pid);
+}
+
+TEST(Profiler, nested_zones) {
+    auto &profiler = Profiler::global();
+    profiler.reset();
+    profiler.enable();
+    for (int i = 0; i < 3; ++i) {
+        ProfileZone zone("query");
+        auto df = DataFrame<int, float>({3, 1, 2}, {30., 10., 20.});
+        auto g = *df.retag([](int t, float v) { return -t; });
+    }
+    std::thread([] { ProfileZone zone("query"); }).join();
+    profiler.disable();
+    {
+        ProfileZone zone("ignored");
+    }
+
+    auto tree = profiler.tree();
+    ASSERT_EQ(tree.children.size(), 1);
+    auto &query = tree.children[0];
+    EXPECT_EQ(query.label, "query");
+    EXPECT_EQ(query.calls, 4);  // Three on this thread, and one on the other.
+    EXPECT_EQ(query.child("Expr_Retag").calls, 3);
+    EXPECT_EQ(query.child("materialize").calls, 6);  // Once by retag, and once by the *.
+    EXPECT_GE(query.nanoseconds, query.child("Expr_Retag").nanoseconds + query.child("materialize").nanoseconds);
+
+    EXPECT_EQ(tree.summary().find("query: "), 0);
+    EXPECT_NE(tree.summary().find("\n  materialize: "), std::string::npos);
+    auto json = tree.json();
+    EXPECT_EQ(json.find(R"({"label": "", "nanoseconds": 0, "calls": 0, "children": [{"label": "query")"), 0);
+
+    // Zones from before a reset don't show up after it.
+    profiler.reset();
+    EXPECT_TRUE(profiler.tree().children.empty());
+    profiler.enable();
+    {
+        ProfileZone zone("after_reset");
+    }
+    profiler.disable();
+    tree = profiler.tree();
+    ASSERT_EQ(tree.children.size(), 1);
+    EXPECT_EQ(tree.children[0].label, "after_reset");
+}
+
+TEST(Profiler, read_while_threads_record) {
+    auto &profiler = Profiler::global();
+    profiler.reset();
+    profiler.enable();
+    std::atomic<bool> done = false;
+    // The reads start once the recorder has closed its first zones.
+    std::latch recorded(1);
+    std::thread recorder([&] {
+        for (int i = 0; !done; ++i) {
+            {
+                ProfileZone outer("outer");
+                ProfileZone inner(i % 2 ? "odd" : "even");
+            }
+            if (i == 0)
+                recorded.count_down();
+        }
+    });
+    recorded.wait();
+    for (int i = 0; i < 1000; ++i)
+        profiler.tree();
+    done = true;
+    recorder.join();
+    profiler.disable();
+
+    auto tree = profiler.tree();
+    ASSERT_EQ(tree.children.size(), 1);
+    auto &outer = tree.children[0];
+    EXPECT_EQ(outer.calls, outer.child("odd").calls + outer.child("even").calls);
+}
+
+TEST(TsvSource, materialize_matches_read_tsv) {
+    auto filename = write_people_tsv("people_stream.tsv", 100);
+    auto expected = read_tsv<Person>(filename);
+
+    // A buffer shorter than a line exercises growing the buffer.
+    auto df = Expr_TsvSource<Person>(filename, 1, 4).materialize();
+
+    ASSERT_EQ(df.size(), expected.size());
+    EXPECT_EQ(df[0].t, 0);
+    EXPECT_EQ(df[99].t, 99);
+    for (size_t i = 0; i < df.size(); ++i) {
+        EXPECT_EQ(df[i].v.name, expected[i].v.name);
+        EXPECT_EQ(df[i].v.age, expected[i].v.age);
+    }
+}
+
+TEST(TsvSource, apply_reduce) {
+    auto people = Expr_TsvSource<Person>(write_people_tsv("people_reduce.tsv", 10, false));
+    auto heights = *people.apply([](const Person &p) { return p.height; }).reduce_max();
+
+    EXPECT_EQ(heights.size(), 10);
+    EXPECT_EQ(heights[9].t, 9);
+    EXPECT_FLOAT_EQ(heights[9].v, 1.5 + 2 * .1);
+}
+
+TEST(TsvSource, collate_with_sorted_index) {
+    auto people = Expr_TsvSource<Person>(write_people_tsv("people_collate.tsv", 100), 1, 16);
+    auto rows = DataFrame<size_t, float>({3, 50, 97}, {0., 0., 0.});
+
+    auto ages = *people.collate(rows, [](const Person &p, float) { return p.age; });
+
+    EXPECT_EQ(*ages.tags, (std::vector<size_t>{3, 50, 97}));
+    EXPECT_EQ(*ages.values, (std::vector<int>{3, 50, 7}));
+}
+
+TEST(TsvSource, advance_to_tag_backwards_ends) {
+    auto people = Expr_TsvSource<Person>(write_people_tsv("people_advance.tsv", 10));
+
+    people.advance_to_tag(4);
+    EXPECT_EQ(people.value().name, "person4");
+    people.advance_to_tag(2);
+    EXPECT_TRUE(people.end());
+}
+
+TEST(WriteTsv, operator_ostream) {
+    std::ostringstream s;
+    s << DataFrame<int, float>({1, 2}, {10.5, 20.});
+
+    EXPECT_EQ(s.str(), "1\t10.5\n2\t20\n");
+}
+
+TEST(WriteTsv, expression) {
+    auto df = DataFrame<int, float>({1, 2, 2, 3}, {10., 20., 100., 30.25});
+
+    std::ostringstream s;
+    write_tsv(df.reduce_sum(), s, "tag\tvalue");
+
+    EXPECT_EQ(s.str(), "tag\tvalue\n1\t10\n2\t120\n3\t30.25\n");
+}
+
+TEST(WriteTsv, csv_quoting) {
+    auto df = DataFrame<StringArena, std::string>({"a", "b"}, {"plain", "has, \"quotes\""});
+
+    std::ostringstream s;
+    write_csv(df, s);
+
+    EXPECT_EQ(s.str(), "a,plain\nb,\"has, \"\"quotes\"\"\"\n");
+}
+
+TEST(WriteTsv, small_buffer) {
+    auto df = DataFrame<RangeTag, int>({100}, std::vector<int>(100, 7));
+
+    std::ostringstream expected, s;
+    expected << df;
+    write_separated(df, s, "", '\t', 10);
+
+    EXPECT_EQ(s.str(), expected.str());
+}
+
+TEST(WriteTsv, parallel_matches_serial) {
+    std::vector<double> values(1000);
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = i / 8.;
+    auto df = DataFrame<RangeTag, double>({values.size()}, values);
+
+    std::ostringstream serial, parallel;
+    write_tsv(df, serial, "row\tvalue");
+    write_tsv_parallel(df, parallel, "row\tvalue", 3, 7);
+
+    EXPECT_EQ(parallel.str(), serial.str());
+}
+
+void format_field(std::string &out, const Person &p, char delimiter) {
+    format_field(out, p.name, delimiter);
+    out += delimiter;
+    format_field(out, p.age, delimiter);
+    out += delimiter;
+    format_field(out, p.height, delimiter);
+}
+
+TEST(WriteTsv, records) {
+    auto df = read_tsv<Person>(write_people_tsv("people_to_write.tsv", 3));
+
+    std::ostringstream s;
+    write_tsv(df, s, "row\tname\tage\theight");
+
+    EXPECT_EQ(s.str(), "row\tname\tage\theight\n0\tperson0\t0\t1.5\n1\tperson1\t1\t1.6\n2\tperson2\t2\t1.7\n");
+}
+
 TEST(GameDemo, dataframe) {
     auto num_games_won =
         matches([](const Game &m) { return m.score_player1 > m.score_player2 ? m.player1 : m.player2; })
@@ -0,0 +1,75 @@
+/*
+Tests of AllocationTracker, which need the counting operator new of
+memory_tracking.cpp. Compile them with
+
+   clang++ -Wall -std=c++2b test_memory_tracking.cpp memory_tracking.cpp -lgtest_main -lgtest
+
+The rest of the tests are in test_dataframe.cpp, which runs on the standard
+allocator.
+*/
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <new>
+#include <string>
+
+#include "dataframe.h"
+
+TEST(AllocationTracker, scopes) {
+    auto &tracker = AllocationTracker::global();
+    tracker.reset();
+    tracker.enable();
+    {
+        AllocationScope scope("pipeline");
+        auto df = DataFrame<std::string, float>({"hi", "ho", "hello"}, {20., 10., 30.});
+        auto g = *df.retag([](const std::string &t, float v) { return -v; });
+    }
+    tracker.disable();
+    auto df = DataFrame<int, float>({1, 2, 3}, {10., 20., 30.});
+    auto g = *df.reduce_sum();
+
+    auto stats = tracker.snapshot();
+    EXPECT_EQ(stats.size(), 3);
+    EXPECT_EQ(stats["pipeline"].calls, 1);
+    EXPECT_EQ(stats["pipeline/Expr_Retag"].calls, 1);
+    EXPECT_EQ(stats["pipeline/materialize"].calls, 2);  // Once by retag, and once by the *.
+    EXPECT_GT(stats["pipeline/Expr_Retag"].allocations, 0);
+    EXPECT_GE(stats["pipeline"].bytes, stats["pipeline/Expr_Retag"].bytes + stats["pipeline/materialize"].bytes);
+}
+
+// Storing pointers here keeps the compiler from eliding the allocations.
+void *volatile escape;
+
+TEST(AllocationTracker, counts_every_form_of_new) {
+    struct alignas(64) Aligned {
+        char bytes[64];
+    };
+
+    auto &tracker = AllocationTracker::global();
+    tracker.reset();
+    tracker.enable();
+    {
+        AllocationScope scope("news");
+        int *i = new int(1);
+        escape = i;
+        delete i;
+        int *a = new int[10];
+        escape = a;
+        delete[] a;
+        int *n = new (std::nothrow) int(2);
+        escape = n;
+        delete n;
+        Aligned *x = new Aligned;
+        escape = x;
+        delete x;
+        Aligned *xs = new Aligned[3];
+        escape = xs;
+        delete[] xs;
+    }
+    tracker.disable();
+
+    auto stats = tracker.snapshot();
+    EXPECT_EQ(stats["news"].allocations, 5);
+    EXPECT_GE(stats["news"].bytes, sizeof(int) * 12 + sizeof(Aligned) * 4);
+}
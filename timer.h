@@ -1,17 +1,257 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
-#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 
-struct Timer {
-    std::chrono::time_point<std::chrono::high_resolution_clock> t_start;
-    std::string context;
+// The time each ProfileZone label took, and how many times it was entered,
+// broken down by the zones that enclosed it.
+struct ProfileTree {
+    std::string label;
+    uint64_t nanoseconds = 0;
+    uint64_t calls = 0;
+    std::vector<ProfileTree> children;
 
-    void start(const std::string &_context) {
-        context = _context;
-        t_start = std::chrono::high_resolution_clock::now();
+    // The child called label, which is added if it's missing.
+    ProfileTree &child(const std::string &label) {
+        for (auto &c : children)
+            if (c.label == label)
+                return c;
+        children.push_back(ProfileTree{label, 0, 0, {}});
+        return children.back();
     }
-    void stop() {
-        auto t_stop = std::chrono::high_resolution_clock::now();
-        std::cout << context << ": " << std::chrono::duration_cast<std::chrono::milliseconds>(t_stop - t_start).count()
-                  << " ms.\n";
+
+    // One line per zone, indented under the zone that encloses it, like
+    //
+    //   query: 12.500 ms in 1 call
+    //     materialize: 10.250 ms in 2 calls
+    std::string summary() const {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        for (const auto &c : children)
+            c.summarize(out, 0);
+        return out.str();
+    }
+
+    void summarize(std::ostream &out, int depth) const {
+        out << std::string(2 * depth, ' ') << label << ": " << nanoseconds / 1e6 << " ms in " << calls
+            << (calls == 1 ? " call\n" : " calls\n");
+        for (const auto &c : children)
+            c.summarize(out, depth + 1);
+    }
+
+    // Remove the zones that weren't entered since the last reset, unless
+    // zones inside them were.
+    void prune() {
+        for (auto &c : children)
+            c.prune();
+        std::erase_if(children, [](const ProfileTree &c) { return c.calls == 0 && c.children.empty(); });
+    }
+
+    // The zones as nested JSON objects, starting with a root that has no
+    // label.
+    std::string json() const {
+        std::ostringstream out;
+        write_json(out);
+        return out.str();
+    }
+
+    void write_json(std::ostream &out) const {
+        out << "{\"label\": \"";
+        for (char c : label) {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (static_cast<unsigned char>(c) < 0x20)
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+            else
+                out << c;
+        }
+        out << "\", \"nanoseconds\": " << nanoseconds << ", \"calls\": " << calls << ", \"children\": [";
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (i)
+                out << ", ";
+            children[i].write_json(out);
+        }
+        out << "]}";
+    }
+};
+
+// Times the code in ProfileZones. Profiling is off by default, and a zone
+// costs a relaxed atomic load when it's off. When it's on, every ProfileZone
+// adds the time it was alive to the totals for its label, under the labels of
+// the zones that enclose it.
+//
+// Each thread records its zones in its own tree, without locks. tree() reads
+// the threads' trees while they're being updated: a thread publishes a new
+// node by linking it into the tree with a release store, after which the
+// node's label and parent don't change, and its totals are atomics.
+struct Profiler {
+    struct Thread {
+        struct Node {
+            const char *label = "";
+            uint32_t parent = 0;
+            // Index 0 is the root, so it means no node here.
+            uint32_t next_sibling = 0;
+            std::atomic<uint32_t> first_child{0};
+            std::atomic<uint64_t> nanoseconds{0};
+            std::atomic<uint64_t> calls{0};
+        };
+
+        // Nodes are allocated in chunks that never move, so readers can follow
+        // indices into them while the thread adds nodes. A thread records at
+        // most max_chunks * chunk_size distinct nestings of labels, and zones
+        // beyond that aren't timed.
+        static constexpr size_t chunk_size = 1024;
+        static constexpr size_t max_chunks = 1024;
+        std::array<std::unique_ptr<Node[]>, max_chunks> chunks;
+
+        // Only the thread itself uses these.
+        uint32_t num_nodes = 1;
+        uint32_t current = 0;
+
+        Thread() { chunks[0].reset(new Node[chunk_size]); }
+
+        Node &node(uint32_t i) const { return chunks[i / chunk_size][i % chunk_size]; }
+
+        // Enter the child of the current zone called label. Labels are usually
+        // string literals, so they're compared by address before by contents.
+        // Returns 0 if the tree is full.
+        uint32_t enter(const char *label) {
+            auto &parent = node(current);
+            for (uint32_t c = parent.first_child.load(std::memory_order_relaxed); c; c = node(c).next_sibling)
+                if (node(c).label == label || std::strcmp(node(c).label, label) == 0)
+                    return current = c;
+
+            if (num_nodes == chunk_size * max_chunks)
+                return 0;
+            uint32_t c = num_nodes++;
+            if (!chunks[c / chunk_size])
+                chunks[c / chunk_size].reset(new Node[chunk_size]);
+            auto &child = node(c);
+            child.label = label;
+            child.parent = current;
+            child.next_sibling = parent.first_child.load(std::memory_order_relaxed);
+            parent.first_child.store(c, std::memory_order_release);
+            return current = c;
+        }
+
+        void exit(uint32_t i, uint64_t nanoseconds) {
+            auto &n = node(i);
+            n.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+            n.calls.fetch_add(1, std::memory_order_relaxed);
+            current = n.parent;
+        }
+
+        // Call f on every node below i that the thread has published.
+        template <typename F>
+        void for_each_child(uint32_t i, F f) const {
+            for (uint32_t c = node(i).first_child.load(std::memory_order_acquire); c; c = node(c).next_sibling)
+                f(c);
+        }
+
+        void merge_into(ProfileTree &tree, uint32_t i) const {
+            for_each_child(i, [&](uint32_t c) {
+                auto &child = tree.child(node(c).label);
+                child.nanoseconds += node(c).nanoseconds.load(std::memory_order_relaxed);
+                child.calls += node(c).calls.load(std::memory_order_relaxed);
+                merge_into(child, c);
+            });
+        }
+
+        void reset(uint32_t i) {
+            for_each_child(i, [&](uint32_t c) {
+                node(c).nanoseconds.store(0, std::memory_order_relaxed);
+                node(c).calls.store(0, std::memory_order_relaxed);
+                reset(c);
+            });
+        }
+    };
+
+    std::atomic<bool> enabled{false};
+    // Guards the list of threads, not their trees.
+    std::mutex mutex;
+    // Kept after their threads exit, so their zones still count.
+    std::vector<std::shared_ptr<Thread>> threads;
+
+    static Profiler &global() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    void enable() { enabled = true; }
+    void disable() { enabled = false; }
+
+    static Thread &this_thread() {
+        thread_local std::shared_ptr<Thread> thread = [] {
+            auto t = std::make_shared<Thread>();
+            auto &profiler = global();
+            std::lock_guard lock(profiler.mutex);
+            profiler.threads.push_back(t);
+            return t;
+        }();
+        return *thread;
+    }
+
+    // Forget the zones recorded so far. Zones that are open keep timing, and
+    // are counted when they close.
+    void reset() {
+        std::lock_guard lock(mutex);
+        for (auto &t : threads)
+            t->reset(0);
+    }
+
+    // The totals of the zones that have closed since the last reset, over all
+    // threads.
+    ProfileTree tree() {
+        ProfileTree tree;
+        {
+            std::lock_guard lock(mutex);
+            for (auto &t : threads)
+                t->merge_into(tree, 0);
+        }
+        tree.prune();
+        return tree;
+    }
+};
+
+// Times the scope it's declared in. The label must outlive the profiler,
+// which a string literal does. For example,
+//
+//   {
+//       ProfileZone zone("load");
+//       df = read_tsv<int, float>("data.tsv");
+//   }
+//   std::cout << Profiler::global().tree().summary();
+struct ProfileZone {
+    Profiler::Thread *thread = nullptr;
+    uint32_t node = 0;
+    std::chrono::steady_clock::time_point t_start;
+
+    ProfileZone(const char *label) {
+        if (!Profiler::global().enabled.load(std::memory_order_relaxed))
+            return;
+        thread = &Profiler::this_thread();
+        node = thread->enter(label);
+        if (node == 0) {
+            thread = nullptr;
+            return;
+        }
+        t_start = std::chrono::steady_clock::now();
+    }
+
+    ProfileZone(const ProfileZone &) = delete;
+
+    ~ProfileZone() {
+        if (!thread)
+            return;
+        auto elapsed = std::chrono::steady_clock::now() - t_start;
+        thread->exit(node, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
     }
 };